@@ -1,6 +1,7 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <thread>
 
 #include "../src/logream_compress.h"
 
@@ -16,6 +17,12 @@ namespace logream::compress_bench {
         void Write(const Slice & s) override {
             mem_.append(s.data(), s.size());
         }
+
+        void WriteV(const Slice * slices, size_t n) override {
+            for (size_t i = 0; i < n; ++i) {
+                mem_.append(slices[i].data(), slices[i].size());
+            }
+        }
     };
 
     class ReaderHelper : public Reader::Helper {
@@ -75,6 +82,21 @@ std::cout << #name " took " << std::chrono::duration_cast<std::chrono::milliseco
         }
         std::cout << "original_size: " << w_total << std::endl;
         std::cout << "compress_size: " << w_helper.mem_.size() << std::endl;
+        std::cout << "writer_memory: " << writer.ApproximateMemoryUsage() << std::endl;
+
+        WriterHelper c_helper;
+        WriterCompress c_writer(&c_helper, 0, true);
+        {
+            TIME_START;
+            for (const auto & s:src) {
+                size_t n = s.size();
+                c_writer.Add(s.data(), &n);
+            }
+            TIME_END;
+            PRINT_TIME(WriterCompress - Add compact index);
+        }
+        std::cout << "compress_size: " << c_helper.mem_.size() << std::endl;
+        std::cout << "writer_memory: " << c_writer.ApproximateMemoryUsage() << std::endl;
 
         size_t r_total = 0;
         ReaderHelper r_helper(w_helper.mem_);
@@ -93,5 +115,65 @@ std::cout << #name " took " << std::chrono::duration_cast<std::chrono::milliseco
             PRINT_TIME(ReaderCompress - Get);
         }
         std::cout << "uncompress_size: " << r_total << std::endl;
+        {
+            TIME_START;
+            [[maybe_unused]] size_t i = 0; // only read by the assert
+            auto it = reader.NewIterator(w_helper.mem_.size());
+            for (it->Seek(0); it->Valid(); it->Next()) {
+                assert(it->record() == Slice(src[i++]));
+            }
+            TIME_END;
+            PRINT_TIME(ReaderCompress - Iterator);
+        }
+        {
+            // decode only: references are cached after the warm-up pass, the log is in memory
+            constexpr unsigned int kRounds = 5;
+            ReaderCompress c_reader(&r_helper, ReaderCompress::kDefaultReadWindow, true);
+            auto it = c_reader.NewIterator(w_helper.mem_.size());
+            for (it->Seek(0); it->Valid(); it->Next()) {}
+            TIME_START;
+            for (size_t i = 0; i < kRounds; ++i) {
+                for (it->Seek(0); it->Valid(); it->Next()) {}
+            }
+            TIME_END;
+            PRINT_TIME(ReaderCompress - Decode);
+            std::cout << "decode_speed: "
+                      << r_total * kRounds / std::chrono::duration<double, std::micro>(end - start).count()
+                      << " MB/s" << std::endl;
+        }
+
+        constexpr unsigned int kThreadNum = 4;
+        WriterHelper p_helper;
+        WriterCompressParallel p_writer(&p_helper, 0, std::thread::hardware_concurrency());
+        std::vector<size_t> ids(src.size());
+        {
+            TIME_START;
+            std::vector<std::thread> jobs;
+            for (size_t i = 0; i < kThreadNum; ++i) {
+                jobs.emplace_back([&](size_t nth) {
+                    for (size_t j = nth; j < src.size(); j += kThreadNum) {
+                        size_t n = src[j].size();
+                        ids[j] = p_writer.Add(src[j].data(), &n);
+                    }
+                }, i);
+            }
+            for (auto & job:jobs) {
+                job.join();
+            }
+            TIME_END;
+            PRINT_TIME(WriterCompressParallel - Add);
+        }
+        std::cout << "compress_size: " << p_helper.mem_.size() << std::endl;
+
+        ReaderHelper p_r_helper(p_helper.mem_);
+        ReaderCompress p_reader(&p_r_helper);
+        {
+            std::string out;
+            for (size_t i = 0; i < src.size(); ++i) {
+                p_reader.Get(ids[i], &out);
+                assert(out == src[i]);
+                out.clear();
+            }
+        }
     }
 }
\ No newline at end of file
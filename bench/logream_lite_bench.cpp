@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <iostream>
@@ -5,6 +7,7 @@
 #include <vector>
 
 #include "../src/logream_lite.h"
+#include "../src/scrubber.h"
 
 namespace logream::lite_bench {
     class WriterHelper : public Writer::Helper {
@@ -18,6 +21,12 @@ namespace logream::lite_bench {
         void Write(const Slice & s) override {
             mem_.append(s.data(), s.size());
         }
+
+        void WriteV(const Slice * slices, size_t n) override {
+            for (size_t i = 0; i < n; ++i) {
+                mem_.append(slices[i].data(), slices[i].size());
+            }
+        }
     };
 
     class ReaderHelper : public Reader::Helper {
@@ -101,5 +110,173 @@ std::cout << #name " took " << std::chrono::duration_cast<std::chrono::milliseco
             PRINT_TIME(ReaderLite - Get);
         }
         std::cout << "text_size: " << total << std::endl;
+        {
+            TIME_START;
+            size_t it_total = 0;
+            auto it = reader.NewIterator(w_helper.mem_.size());
+            for (it->Seek(0); it->Valid(); it->Next()) {
+                it_total += it->record().size();
+            }
+            TIME_END;
+            PRINT_TIME(ReaderLite - Iterator);
+            assert(it_total == total);
+        }
+        {
+            ReaderLite nv_reader(&r_helper, Reader::kDefaultReadWindow, Reader::kVerifyNever);
+            TIME_START;
+            size_t id = 0;
+            std::string out;
+            for (size_t i = 0; i < src.size(); ++i) {
+                id = nv_reader.Get(id, &out);
+                out.clear();
+            }
+            TIME_END;
+            PRINT_TIME(ReaderLite - Get no verify);
+        }
+        {
+            TIME_START;
+            Scrubber scrubber(&reader, 0, w_helper.mem_.size());
+            scrubber.Wait();
+            TIME_END;
+            PRINT_TIME(Scrubber);
+            assert(scrubber.verified() == w_helper.mem_.size());
+        }
+
+        WriterHelper lf_helper;
+        WriterLiteLockFree lf_writer(&lf_helper, 0);
+        {
+            TIME_START;
+            std::vector<std::thread> jobs;
+            for (size_t i = 0; i < kThreadNum; ++i) {
+                jobs.emplace_back([&](size_t nth) {
+                    for (size_t j = 0; j < src.size(); ++j) {
+                        if (j % kThreadNum == nth) {
+                            size_t n = src[j].size();
+                            lf_writer.Add(src[j].data(), &n);
+                        }
+                    }
+                }, i);
+            }
+            for (auto & job:jobs) {
+                job.join();
+            }
+            TIME_END;
+            PRINT_TIME(WriterLiteLockFree - Add);
+        }
+        assert(lf_helper.mem_.size() == w_helper.mem_.size());
+
+        WriterHelper a_helper;
+        std::atomic<size_t> completed = 0;
+        {
+            TIME_START;
+            WriterLite a_writer(&a_helper, 0);
+            std::vector<std::thread> jobs;
+            for (size_t i = 0; i < kThreadNum; ++i) {
+                jobs.emplace_back([&](size_t nth) {
+                    for (size_t j = 0; j < src.size(); ++j) {
+                        if (j % kThreadNum == nth) {
+                            size_t n = src[j].size();
+                            a_writer.AddAsync(src[j].data(), &n, [&](std::exception_ptr) {
+                                ++completed;
+                            });
+                        }
+                    }
+                }, i);
+            }
+            for (auto & job:jobs) {
+                job.join();
+            }
+            TIME_END;
+            PRINT_TIME(WriterLite - AddAsync);
+        }
+        assert(completed == src.size());
+        assert(a_helper.mem_.size() == w_helper.mem_.size());
+
+        // callbacks that add again, they run on the flusher while producers keep adding
+        WriterHelper r_a_helper;
+        std::atomic<size_t> re_added = 0;
+        {
+            TIME_START;
+            WriterLite r_a_writer(&r_a_helper, 0);
+            std::vector<std::thread> jobs;
+            for (size_t i = 0; i < kThreadNum; ++i) {
+                jobs.emplace_back([&](size_t nth) {
+                    for (size_t j = nth; j < src.size(); j += kThreadNum) {
+                        size_t n = src[j].size();
+                        r_a_writer.AddAsync(src[j].data(), &n, [&, j](std::exception_ptr) {
+                            if (j % 2 == 0) {
+                                size_t m = src[j].size();
+                                r_a_writer.Add(src[j].data(), &m);
+                                ++re_added;
+                            }
+                        });
+                    }
+                }, i);
+            }
+            for (auto & job:jobs) {
+                job.join();
+            }
+            TIME_END;
+            PRINT_TIME(WriterLite - AddAsync re-entrant);
+        }
+        assert(re_added == (src.size() + 1) / 2);
+
+        constexpr unsigned int kBatchSize = 256;
+        WriterHelper b_helper;
+        WriterLite b_writer(&b_helper, 0);
+        {
+            TIME_START;
+            std::vector<std::thread> jobs;
+            for (size_t i = 0; i < kThreadNum; ++i) {
+                jobs.emplace_back([&](size_t nth) {
+                    std::vector<Slice> records;
+                    std::vector<size_t> ids(kBatchSize);
+                    for (size_t j = nth; j < src.size(); j += kThreadNum) {
+                        records.emplace_back(src[j]);
+                        if (records.size() == kBatchSize || j + kThreadNum >= src.size()) {
+                            b_writer.AddBatch(records.data(), records.size(), ids.data());
+                            records.clear();
+                        }
+                    }
+                }, i);
+            }
+            for (auto & job:jobs) {
+                job.join();
+            }
+            TIME_END;
+            PRINT_TIME(WriterLite - AddBatch);
+        }
+        assert(b_helper.mem_.size() == w_helper.mem_.size());
+
+        // per-Add latency, parking at once vs spinning first
+        for (size_t spin:{size_t(0), WriterLite::kDefaultSpin}) {
+            WriterHelper l_helper;
+            WriterLite l_writer(&l_helper, 0, spin);
+            std::vector<std::vector<uint64_t>> latencies(kThreadNum);
+            std::vector<std::thread> jobs;
+            for (size_t i = 0; i < kThreadNum; ++i) {
+                jobs.emplace_back([&](size_t nth) {
+                    for (size_t j = nth; j < src.size(); j += kThreadNum) {
+                        size_t n = src[j].size();
+                        auto t = std::chrono::high_resolution_clock::now();
+                        l_writer.Add(src[j].data(), &n);
+                        latencies[nth].emplace_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::high_resolution_clock::now() - t).count());
+                    }
+                }, i);
+            }
+            for (auto & job:jobs) {
+                job.join();
+            }
+
+            std::vector<uint64_t> all;
+            for (const auto & v:latencies) {
+                all.insert(all.cend(), v.cbegin(), v.cend());
+            }
+            std::sort(all.begin(), all.end());
+            std::cout << "WriterLite - Add spin " << spin
+                      << " p50 " << all[all.size() / 2] << "ns"
+                      << " p99 " << all[all.size() * 99 / 100] << "ns" << std::endl;
+        }
     }
 }
\ No newline at end of file
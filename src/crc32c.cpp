@@ -1,13 +1,49 @@
-#include <nmmintrin.h>
+#include <cstring>
+#include <immintrin.h>
 
 #include "crc32c.h"
 
 namespace logream::crc32c {
-    uint32_t Extend(uint32_t init_crc, const char * data, size_t n) {
-        const auto * p = reinterpret_cast<const uint8_t *>(data);
-        const auto * e = p + n;
-        uint32_t l = (init_crc ^ 0xffffffffu);
+    // All values below are bit-reflected, as the crc32 instruction uses them: bit i of a 32-bit value is x ** (31 - i)
+    constexpr uint32_t kPoly = 0x82f63b78u;
+
+    // a * b mod P
+    static constexpr uint32_t MultiplyMod(uint32_t a, uint32_t b) {
+        uint32_t product = 0;
+        for (int i = 0; i < 32; ++i) {
+            if ((a & (0x80000000u >> i)) != 0) {
+                product ^= b;
+            }
+            b = (b >> 1) ^ ((b & 1) != 0 ? kPoly : 0);
+        }
+        return product;
+    }
+
+    // x ** e mod P
+    static constexpr uint32_t XPowMod(size_t e) {
+        uint32_t result = 0x80000000u;
+        uint32_t base = 0x40000000u;
+        for (; e != 0; e >>= 1) {
+            if ((e & 1) != 0) {
+                result = MultiplyMod(result, base);
+            }
+            base = MultiplyMod(base, base);
+        }
+        return result;
+    }
+
+    // _mm_crc32_u64(0, clmul(crc, ShiftConstant(n))) is crc moved past n zero bytes: clmul adds x, crc32 x ** 32
+    static constexpr uint64_t ShiftConstant(size_t n) {
+        return XPowMod(8 * n - 33);
+    }
+
+    // Operand of a 64 x 64 clmul that multiplies the other, half of a 128-bit block, by x ** e mod P
+    // The product lands one bit short of the block layout, hence e - 1
+    static constexpr uint64_t FoldConstant(size_t e) {
+        return static_cast<uint64_t>(XPowMod(e - 1)) << 32;
+    }
 
+    static inline uint32_t ExtendSse42(uint32_t l, const uint8_t * p, const uint8_t * e) {
 #define STEP1 do {                              \
     l = _mm_crc32_u8(l, *p++);                  \
 } while (false)
@@ -20,7 +56,7 @@ namespace logream::crc32c {
     p += 8;                                     \
 } while (false)
 
-        if (n > 16) {
+        if (e - p > 16) {
             for (size_t i = reinterpret_cast<uintptr_t>(p) % 8; i != 0; --i) {
                 STEP1;
             }
@@ -45,6 +81,151 @@ namespace logream::crc32c {
 #undef STEP1
 #undef STEP4
 #undef STEP8
-        return l ^ 0xffffffffu;
+        return l;
+    }
+
+#if defined(_M_X64) || defined(__x86_64__)
+    // Three streams of kStride bytes side by side hide the latency of crc32, clmul joins them
+    template<size_t kStride>
+    __attribute__((target("sse4.2,pclmul")))
+    static inline uint32_t ExtendStreams(uint32_t l, const uint8_t ** pp, const uint8_t * e) {
+        static_assert(kStride % 8 == 0);
+        constexpr uint64_t kShift1 = ShiftConstant(kStride);
+        constexpr uint64_t kShift2 = ShiftConstant(kStride * 2);
+
+        const uint8_t * p = *pp;
+        uint64_t l0 = l;
+        while (static_cast<size_t>(e - p) >= kStride * 3) {
+            uint64_t l1 = 0;
+            uint64_t l2 = 0;
+            for (size_t i = 0; i < kStride; i += 8) {
+                uint64_t v0;
+                uint64_t v1;
+                uint64_t v2;
+                memcpy(&v0, p + i, sizeof(v0));
+                memcpy(&v1, p + kStride + i, sizeof(v1));
+                memcpy(&v2, p + kStride * 2 + i, sizeof(v2));
+                l0 = _mm_crc32_u64(l0, v0);
+                l1 = _mm_crc32_u64(l1, v1);
+                l2 = _mm_crc32_u64(l2, v2);
+            }
+            const __m128i m0 = _mm_clmulepi64_si128(_mm_cvtsi64_si128(l0), _mm_cvtsi64_si128(kShift2), 0x00);
+            const __m128i m1 = _mm_clmulepi64_si128(_mm_cvtsi64_si128(l1), _mm_cvtsi64_si128(kShift1), 0x00);
+            l0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(m0, m1))) ^ l2;
+            p += kStride * 3;
+        }
+        *pp = p;
+        return static_cast<uint32_t>(l0);
+    }
+
+    __attribute__((target("sse4.2,pclmul")))
+    static uint32_t ExtendPclmul(uint32_t l, const uint8_t * p, const uint8_t * e) {
+        l = ExtendStreams<4096>(l, &p, e);
+        l = ExtendStreams<512>(l, &p, e);
+        l = ExtendStreams<96>(l, &p, e);
+        l = ExtendStreams<24>(l, &p, e);
+        return ExtendSse42(l, p, e);
+    }
+
+    // Fold each 128-bit lane of x forward by n bytes, the result lines up with the lane n bytes later
+#define FOLD_CONSTANTS(n) FoldConstant(8 * (n) + 64), FoldConstant(8 * (n))
+
+    __attribute__((target("sse4.2,pclmul")))
+    static inline __m128i Fold128(__m128i x, __m128i k) {
+        return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+    }
+
+    __attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+    static inline __m512i Fold512(__m512i x, __m512i k) {
+        return _mm512_xor_si512(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11));
+    }
+
+    static inline __m128i Set128(uint64_t lo, uint64_t hi) {
+        return _mm_set_epi64x(static_cast<long long>(hi), static_cast<long long>(lo));
+    }
+
+    __attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+    static inline __m512i Broadcast(uint64_t lo, uint64_t hi) {
+        // set directly, GCC's _mm512_broadcast_i32x4 trips -Wmaybe-uninitialized
+        const auto l = static_cast<long long>(lo);
+        const auto h = static_cast<long long>(hi);
+        return _mm512_set_epi64(h, l, h, l, h, l, h, l);
+    }
+
+    // The zero-masked extract under a full mask, the plain one trips -Wmaybe-uninitialized as well
+    template<int kLane>
+    __attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+    static inline __m128i Lane(__m512i x) {
+        return _mm512_maskz_extracti32x4_epi32(0xf, x, kLane);
+    }
+
+    // Fold 256 bytes a round in four 512-bit accumulators, the 16 bytes left are run through crc32
+    __attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+    static uint32_t ExtendVpclmul(uint32_t l, const uint8_t * p, const uint8_t * e) {
+        // below this, zmm start-up costs more than it saves on records read one by one
+        constexpr size_t kMinSize = 1024;
+        if (static_cast<size_t>(e - p) < kMinSize) {
+            return ExtendPclmul(l, p, e);
+        }
+
+        // a starting crc is the same as xoring it into the first 4 bytes
+        __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(p),
+                                      _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128(l), 0));
+        __m512i x1 = _mm512_loadu_si512(p + 64);
+        __m512i x2 = _mm512_loadu_si512(p + 128);
+        __m512i x3 = _mm512_loadu_si512(p + 192);
+        p += 256;
+
+        const __m512i k256 = Broadcast(FOLD_CONSTANTS(256));
+        while (e - p >= 256) {
+            x0 = _mm512_xor_si512(Fold512(x0, k256), _mm512_loadu_si512(p));
+            x1 = _mm512_xor_si512(Fold512(x1, k256), _mm512_loadu_si512(p + 64));
+            x2 = _mm512_xor_si512(Fold512(x2, k256), _mm512_loadu_si512(p + 128));
+            x3 = _mm512_xor_si512(Fold512(x3, k256), _mm512_loadu_si512(p + 192));
+            p += 256;
+        }
+
+        const __m512i k64 = Broadcast(FOLD_CONSTANTS(64));
+        __m512i x = _mm512_xor_si512(Fold512(x0, Broadcast(FOLD_CONSTANTS(192))),
+                                     Fold512(x1, Broadcast(FOLD_CONSTANTS(128))));
+        x = _mm512_xor_si512(x, Fold512(x2, k64));
+        x = _mm512_xor_si512(x, x3);
+        while (e - p >= 64) {
+            x = _mm512_xor_si512(Fold512(x, k64), _mm512_loadu_si512(p));
+            p += 64;
+        }
+
+        // lanes to one, its 16 bytes stand for everything folded so far
+        __m128i v = _mm_xor_si128(Fold128(Lane<0>(x), Set128(FOLD_CONSTANTS(48))),
+                                  Fold128(Lane<1>(x), Set128(FOLD_CONSTANTS(32))));
+        v = _mm_xor_si128(v, Fold128(Lane<2>(x), Set128(FOLD_CONSTANTS(16))));
+        v = _mm_xor_si128(v, Lane<3>(x));
+        l = static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(v))));
+        l = static_cast<uint32_t>(_mm_crc32_u64(l, static_cast<uint64_t>(_mm_extract_epi64(v, 1))));
+        return ExtendPclmul(l, p, e);
+    }
+#undef FOLD_CONSTANTS
+#endif  // defined(_M_X64) || defined(__x86_64__)
+
+    typedef uint32_t (* ExtendFunction)(uint32_t l, const uint8_t * p, const uint8_t * e);
+
+    static ExtendFunction ChooseExtend() {
+#if defined(_M_X64) || defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+            __builtin_cpu_supports("vpclmulqdq")) {
+            return ExtendVpclmul;
+        }
+        if (__builtin_cpu_supports("pclmul")) {
+            return ExtendPclmul;
+        }
+#endif  // defined(_M_X64) || defined(__x86_64__)
+        return ExtendSse42;
+    }
+
+    uint32_t Extend(uint32_t init_crc, const char * data, size_t n) {
+        static const ExtendFunction extend = ChooseExtend();
+        const auto * p = reinterpret_cast<const uint8_t *>(data);
+        return extend(init_crc ^ 0xffffffffu, p, p + n) ^ 0xffffffffu;
     }
 }
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include <cstdint>
 
 namespace logream::crc32c {
+    // Runs on the fastest path the CPU has: VPCLMULQDQ folding, three crc32 streams joined with PCLMULQDQ, or plain crc32
     uint32_t Extend(uint32_t init_crc, const char * data, size_t n);
 
     inline uint32_t Value(const char * data, size_t n) {
@@ -40,6 +40,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "divsufsort.h"
 
 /*- Constants -*/
@@ -1435,6 +1439,54 @@ trsort(int *ISA, int *SA, int n, int depth) {
 
 /*---------------------------------------------------------------------------*/
 
+#ifndef LIBBSC_OPENMP
+/* Sorts the type B* substrings bucket by bucket with sssort on threads threads,
+   the caller included. Buckets are handed out as in the OpenMP version. */
+static
+void
+sssort_buckets(const unsigned char *T, const int *PAb, int *SA,
+               const int *bucket_B, int n, int m, int threads) {
+    std::mutex mutex;
+    int c0 = ALPHABET_SIZE - 2, c1 = ALPHABET_SIZE - 1, j = m;
+    const int bufsize = (n - (2 * m)) / threads;
+
+    auto work = [&](int *curbuf) {
+        for(;;) {
+            int k = 0, l;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(0 < (l = j)) {
+                    int d0 = c0, d1 = c1;
+                    do {
+                        k = BUCKET_BSTAR(d0, d1);
+                        if(--d1 <= d0) {
+                            d1 = ALPHABET_SIZE - 1;
+                            if(--d0 < 0) { break; }
+                        }
+                    } while(((l - k) <= 1) && (0 < (l = k)));
+                    c0 = d0, c1 = d1, j = k;
+                }
+            }
+            if(l == 0) { break; }
+            sssort(T, PAb, SA + k, SA + l,
+                   curbuf, bufsize, 2, n, *(SA + k) == (m - 1));
+        }
+    };
+
+    std::vector<std::thread> jobs;
+    for(int t = 1; t < threads; ++t) {
+        try {
+            jobs.emplace_back(work, SA + m + t * bufsize);
+        } catch(...) {
+            /* fewer threads, the rest of the buckets are left to the others */
+            break;
+        }
+    }
+    work(SA + m);
+    for(auto &job : jobs) { job.join(); }
+}
+#endif
+
 /* Sorts suffixes of type B*. */
 static
 int
@@ -1451,7 +1503,6 @@ sort_typeBstar(const unsigned char *T, int *SA,
 #ifdef LIBBSC_OPENMP
     int d0, d1;
 #endif
-    (void)openMP;
 
     /* Initialize bucket arrays. */
     for(i = 0; i < BUCKET_A_SIZE; ++i) { bucket_A[i] = 0; }
@@ -1548,13 +1599,17 @@ note:
         }
     }
 #else
-        buf = SA + m, bufsize = n - (2 * m);
-        for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
-            for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
-                i = BUCKET_BSTAR(c0, c1);
-                if(1 < (j - i)) {
-                    sssort(T, PAb, SA + i, SA + j,
-                           buf, bufsize, 2, n, *(SA + i) == (m - 1));
+        if(1 < openMP) {
+            sssort_buckets(T, PAb, SA, bucket_B, n, m, openMP);
+        } else {
+            buf = SA + m, bufsize = n - (2 * m);
+            for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
+                for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
+                    i = BUCKET_BSTAR(c0, c1);
+                    if(1 < (j - i)) {
+                        sssort(T, PAb, SA + i, SA + j,
+                               buf, bufsize, 2, n, *(SA + i) == (m - 1));
+                    }
                 }
             }
         }
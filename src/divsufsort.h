@@ -43,7 +43,8 @@ extern "C" {
  * @param T [0..n-1] The input string.
  * @param SA [0..n-1] The output array of suffixes.
  * @param n The length of the given string.
- * @param openMP enables OpenMP optimization.
+ * @param openMP enables OpenMP optimization. Without OpenMP, the number of
+ *               threads sorting type B* substrings, 0 or 1 for the caller alone.
  * @return 0 if no error occurred, -1 or -2 otherwise.
  */
 int
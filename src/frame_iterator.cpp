@@ -0,0 +1,90 @@
+#include <algorithm>
+
+#include "coding.h"
+#include "crc32c.h"
+#include "frame_iterator.h"
+
+namespace logream {
+    size_t ViewFrame(const Reader::Helper * helper, size_t id, Slice * payload, uint32_t * crc) {
+        const char * head = helper->View(id, kMaxVarint32Length);
+        assert(head != nullptr);
+        Slice buf(head, kMaxVarint32Length);
+        uint32_t size;
+        if (!GetVarint32(&buf, &size)) {
+            return 0;
+        }
+
+        const size_t varint_size = kMaxVarint32Length - buf.size();
+        const size_t data_size = varint_size + size;
+        const size_t read_size = data_size + sizeof(uint32_t);
+        const char * frame = helper->View(id, read_size);
+        if (frame == nullptr) {
+            return 0;
+        }
+        memcpy(crc, frame + data_size, sizeof(*crc));
+        *crc = crc32c::Unmask(*crc);
+        *payload = {frame + varint_size, size};
+        return id + read_size;
+    }
+
+    void FrameIterator::Seek(size_t id) {
+        offset_ = id;
+        Load();
+    }
+
+    void FrameIterator::Next() {
+        assert(valid_);
+        offset_ = next_;
+        Load();
+    }
+
+    void FrameIterator::Load() {
+        valid_ = false;
+        if (offset_ >= end_) {
+            return;
+        }
+
+        const size_t head_size = std::min<size_t>(kMaxVarint32Length, end_ - offset_);
+        if (!Holds(offset_, head_size)) {
+            Fill(offset_, block_size_);
+        }
+        Slice buf(&block_[offset_ - block_offset_], head_size);
+        uint32_t size;
+        if (!GetVarint32(&buf, &size)) {
+            return;
+        }
+
+        const size_t varint_size = head_size - buf.size();
+        const size_t data_size = varint_size + size;
+        const size_t read_size = data_size + sizeof(uint32_t);
+        if (read_size > end_ - offset_) {
+            return;
+        }
+        // the frame crosses the block, restart the block at it
+        if (!Holds(offset_, read_size)) {
+            Fill(offset_, std::max(block_size_, read_size));
+        }
+
+        const char * frame = &block_[offset_ - block_offset_];
+        uint32_t crc;
+        memcpy(&crc, frame + data_size, sizeof(crc));
+        crc = crc32c::Unmask(crc);
+        if (!Expand(offset_, {frame + varint_size, size}, crc, &record_)) {
+            return;
+        }
+        next_ = offset_ + read_size;
+        valid_ = true;
+    }
+
+    void FrameIterator::Fill(size_t offset, size_t n) {
+        n = std::min(n, end_ - offset);
+        block_offset_ = offset;
+        block_.resize(n);
+        try {
+            helper_->ReadAt(offset, n, block_.data());
+        } catch (...) {
+            block_.clear();
+            throw;
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+#ifndef LOGREAM_FRAME_ITERATOR_H
+#define LOGREAM_FRAME_ITERATOR_H
+
+/*
+ * 按块顺序读取 varint + data + crc32c 帧的迭代器
+ *
+ * 每次以一个大块(默认 1MB)读取, 帧直接在块内解析, 跨块的帧从其起点重新读一块
+ * 记录内容由子类从帧中取得: 不压缩的格式直接指向块内, 无需复制
+ * ViewFrame 在 Helper 的映射内原地解析一帧, 供 GetView 使用
+ */
+
+#include "logream.h"
+
+namespace logream {
+    // The frame at id in place, helper must View at least its first bytes
+    // Return the next id, 0 on error, the crc is left to the caller
+    size_t ViewFrame(const Reader::Helper * helper, size_t id, Slice * payload, uint32_t * crc);
+
+    class FrameIterator : public Reader::Iterator {
+    private:
+        const Reader::Helper * const helper_;
+        const size_t end_;
+        const size_t block_size_;
+        std::string block_;
+        size_t block_offset_ = 0;
+        size_t offset_ = 0;
+        size_t next_ = 0;
+        Slice record_;
+        bool valid_ = false;
+
+    public:
+        static constexpr size_t kDefaultBlockSize = 1048576; // 1MB
+
+        FrameIterator(const Reader::Helper * helper, size_t end, size_t block_size = kDefaultBlockSize)
+                : helper_(helper),
+                  end_(end),
+                  block_size_(block_size) {}
+
+        FrameIterator(const FrameIterator &) = delete;
+
+        FrameIterator & operator=(const FrameIterator &) = delete;
+
+        ~FrameIterator() override = default;
+
+    public:
+        void Seek(size_t id) override;
+
+        bool Valid() const override {
+            return valid_;
+        }
+
+        void Next() override;
+
+        Slice record() const override {
+            return record_;
+        }
+
+        size_t offset() const override {
+            return offset_;
+        }
+
+    protected:
+        // Turn the payload of the frame at id into *record, return false on corruption
+        // *record may point into payload, which stays valid until the next Seek/Next
+        virtual bool Expand(size_t id, const Slice & payload, uint32_t crc, Slice * record) = 0;
+
+    private:
+        void Load();
+
+        // Make block_ hold [offset, offset + n), n is clamped to end_
+        void Fill(size_t offset, size_t n);
+
+        bool Holds(size_t offset, size_t n) const {
+            return offset >= block_offset_ && offset + n <= block_offset_ + block_.size();
+        }
+    };
+}
+
+#endif //LOGREAM_FRAME_ITERATOR_H
@@ -8,6 +8,11 @@
  * 完成时间: 2018夏初
  */
 
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+
 #include "slice.h"
 
 namespace logream {
@@ -21,8 +26,21 @@ namespace logream {
 
         public:
             virtual void Write(const Slice & s) = 0;
+
+            // Write n slices back to back, as if they were one
+            // The default concatenates them for Write, override it (e.g. with writev) to skip the copy
+            virtual void WriteV(const Slice * slices, size_t n) {
+                std::string buf;
+                for (size_t i = 0; i < n; ++i) {
+                    buf.append(slices[i].data(), slices[i].size());
+                }
+                Write(buf);
+            }
         };
 
+        // Called with nullptr once the record has been written through Helper, or with the error
+        typedef std::function<void(std::exception_ptr)> Callback;
+
     public:
         Writer() = default;
 
@@ -30,6 +48,24 @@ namespace logream {
 
     public:
         virtual size_t Add(const char * data, size_t * n) = 0;
+
+        // Add records[0, n), ids[i] receives the offset of records[i]
+        // The default adds them one by one
+        virtual void AddBatch(const Slice * records, size_t n, size_t * ids) {
+            for (size_t i = 0; i < n; ++i) {
+                size_t len = records[i].size();
+                ids[i] = Add(records[i].data(), &len);
+            }
+        }
+
+        // Return the offset without waiting for Helper, data is copied
+        // Throw without calling callback if the record cannot be accepted at all
+        // The default is synchronous: Add, then callback
+        virtual size_t AddAsync(const char * data, size_t * n, Callback callback) {
+            const size_t id = Add(data, n);
+            callback(nullptr);
+            return id;
+        }
     };
 
     class Reader {
@@ -42,8 +78,49 @@ namespace logream {
 
         public:
             virtual void ReadAt(size_t offset, size_t n, char * scratch) const = 0;
+
+            // Read up to n bytes, fewer only at the end of the log, return how many were read
+            // Return 0 if not supported, readers then size every ReadAt exactly
+            virtual size_t ReadAtMost(size_t /* offset */, size_t /* n */, char * /* scratch */) const {
+                return 0;
+            }
+
+            // [offset, offset + n) in place, valid as long as the helper, nullptr if not mapped
+            virtual const char * View(size_t /* offset */, size_t /* n */) const {
+                return nullptr;
+            }
+        };
+
+        // Forward iteration over consecutive records
+        class Iterator {
+        public:
+            Iterator() = default;
+
+            virtual ~Iterator() = default;
+
+        public:
+            // Position at the record at id
+            virtual void Seek(size_t id) = 0;
+
+            // False at the end of the log, or at a record that fails to decode
+            virtual bool Valid() const = 0;
+
+            virtual void Next() = 0;
+
+            // Valid until the next Seek/Next
+            virtual Slice record() const = 0;
+
+            virtual size_t offset() const = 0;
         };
 
+        // bytes a reader fetches speculatively, most records need no second read
+        static constexpr size_t kDefaultReadWindow = 4096;
+
+        // verify_every of readers that take one: check crc32c on every record, on none, or on 1 in n
+        // Iterators always check, a Scrubber covers what point reads skip
+        static constexpr size_t kVerifyAlways = 1;
+        static constexpr size_t kVerifyNever = 0;
+
     public:
         Reader() = default;
 
@@ -52,7 +129,84 @@ namespace logream {
     public:
         // Return 0 on error
         virtual size_t Get(size_t id, std::string * s) const = 0;
+
+        // Point *record at the record at id, into the helper's mapping where possible, otherwise into *scratch
+        // Return as Get. The default copies with Get
+        virtual size_t GetView(size_t id, Slice * record, std::string * scratch) const {
+            scratch->clear();
+            const size_t next = Get(id, scratch);
+            *record = *scratch;
+            return next;
+        }
+
+        // results[i] receives what Get(ids[i], &s[i]) returns
+        // The default gets them one by one
+        virtual void MultiGet(const size_t * ids, size_t n, std::string * s, size_t * results) const {
+            for (size_t i = 0; i < n; ++i) {
+                results[i] = Get(ids[i], &s[i]);
+            }
+        }
+
+        // Iterate the log up to end, i.e. its size, Seek first
+        // The default walks with Get
+        virtual std::unique_ptr<Iterator> NewIterator(size_t end) const;
+
+    protected:
+        // True for 1 in verify_every calls counted by *n, a reader passes its own counter
+        static bool Sample(size_t verify_every, std::atomic<size_t> * n) {
+            if (verify_every == kVerifyNever || verify_every == kVerifyAlways) {
+                return verify_every == kVerifyAlways;
+            }
+            return (n->fetch_add(1, std::memory_order_relaxed) + 1) % verify_every == 0;
+        }
     };
+
+    class GetIterator : public Reader::Iterator {
+    private:
+        const Reader * const reader_;
+        const size_t end_;
+        size_t offset_ = 0;
+        size_t next_ = 0;
+        std::string record_;
+
+    public:
+        GetIterator(const Reader * reader, size_t end)
+                : reader_(reader),
+                  end_(end) {}
+
+        ~GetIterator() override = default;
+
+    public:
+        void Seek(size_t id) override {
+            offset_ = id;
+            next_ = 0;
+            if (offset_ < end_) {
+                record_.clear();
+                next_ = reader_->Get(offset_, &record_);
+            }
+        }
+
+        bool Valid() const override {
+            return next_ != 0;
+        }
+
+        void Next() override {
+            assert(Valid());
+            Seek(next_);
+        }
+
+        Slice record() const override {
+            return record_;
+        }
+
+        size_t offset() const override {
+            return offset_;
+        }
+    };
+
+    inline std::unique_ptr<Reader::Iterator> Reader::NewIterator(size_t end) const {
+        return std::make_unique<GetIterator>(this, end);
+    }
 }
 
 #endif //LOGREAM_LOGREAM_H
@@ -1,12 +1,17 @@
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <climits>
+#include <cstring>
+#include <emmintrin.h>
 
 #include "bloom.h"
 #include "coding.h"
 #include "crc32c.h"
 #include "divsufsort.h"
+#include "frame_iterator.h"
 #include "logream_compress.h"
+#include "multi_get.h"
 #include "prefetch.h"
 
 namespace logream {
@@ -25,33 +30,302 @@ namespace logream {
         kNormalClose = kNormal + 63,
     };
     static_assert(kNormalClose == UINT8_MAX);
+
+    // What a mark byte says about its token
+    struct MarkInfo {
+        enum Kind : uint8_t {
+            kLiteral,
+            kWarZoneRef,
+            kBattlefieldRef,
+            kFrontlineRef,
+        };
+
+        Kind kind;
+        uint8_t len;       // inline length, 0 if a varint32 length follows
+        uint8_t pos_size;  // bytes of position after the length
+        uint32_t pos_mask; // keeps pos_size bytes of a 4-byte load
+    };
+
+    static constexpr std::array<MarkInfo, UINT8_MAX + 1> BuildMarkTable() {
+        std::array<MarkInfo, UINT8_MAX + 1> table{};
+        for (unsigned int mark = 0; mark <= UINT8_MAX; ++mark) {
+            MarkInfo & info = table[mark];
+            info.len = static_cast<uint8_t>(mark & kInlineSize);
+            if (mark >= kNormal) {
+                info.kind = MarkInfo::kLiteral;
+                info.pos_size = 0;
+            } else if (mark >= kFrontline) {
+                info.kind = MarkInfo::kFrontlineRef;
+                info.pos_size = 1;
+            } else if (mark >= kBattlefield) {
+                info.kind = MarkInfo::kBattlefieldRef;
+                info.pos_size = 2;
+            } else {
+                info.kind = MarkInfo::kWarZoneRef;
+                info.pos_size = 3;
+            }
+            info.pos_mask = info.pos_size == 0 ? 0 : UINT32_MAX >> (32 - 8 * info.pos_size);
+        }
+        return table;
+    }
+
+    static constexpr std::array<MarkInfo, UINT8_MAX + 1> kMarkTable = BuildMarkTable();
     typedef Bloom<SliceHasher> BloomFilter;
 
+    // sa as FindLongestRepeat reads it, 4 bytes a suffix or packed into 3
+    struct PlainSA {
+        const int * p;
+
+        int operator[](int i) const {
+            return p[i];
+        }
+
+        const void * address(int i) const {
+            return p + i;
+        }
+    };
+
+    struct PackedSA {
+        const unsigned char * p;
+
+        int operator[](int i) const {
+            uint32_t v;
+            memcpy(&v, p + i * 3, sizeof(v));
+            return static_cast<int>(v & 0xffffff);
+        }
+
+        const void * address(int i) const {
+            return p + i * 3;
+        }
+    };
+
+    // The 2-byte prefix of each suffix only rises along sa, a lone last byte sorts first among its own
+    template<typename SA>
+    static void BuildJumpTable(const unsigned char * src, const SA & sa, int n, std::vector<int> * jump) {
+        jump->resize(UINT16_MAX + 2);
+        int next = 0;
+        for (int r = 0; r < n; ++r) {
+            const int i = sa[r];
+            const int key = src[i] << 8 | (i + 1 < n ? src[i + 1] : 0);
+            for (; next <= key; ++next) {
+                (*jump)[next] = r;
+            }
+        }
+        for (; next < static_cast<int>(jump->size()); ++next) {
+            (*jump)[next] = n;
+        }
+    }
+
+    // Walk the first levels of the LCP-LR tree the way FindLongestRepeat does
+    // A child's bounds share at least what its parent's do (common), each LCP is compared on from there
+    template<typename SA, typename Line>
+    static void BuildTopLevels(const unsigned char * src, const SA & sa, int n, int levels, std::vector<Line> * top) {
+        top->assign((size_t(1) << levels) / 4, {});
+        auto lcp = [src, n](int i, int j, int common) {
+            for (; common < UINT16_MAX && i + common < n && j + common < n && src[i + common] == src[j + common];
+                   ++common) {}
+            return common;
+        };
+        auto walk = [&](int i, int l, int r, int common, int depth, auto && func) -> void {
+            if (depth == levels) {
+                return;
+            }
+            const int mid = (l + r) / 2;
+            auto & node = (*top)[i / 4].nodes[i % 4];
+            node.sa = sa[mid];
+            memcpy(node.prefix, src + node.sa, std::min<size_t>(sizeof(node.prefix), n - node.sa));
+            // the search compares at a leaf and stops, its lcplr is never read
+            if (r - l <= 2) {
+                return;
+            }
+            node.lcplr[0] = static_cast<uint16_t>(lcp(sa[l], node.sa, common));
+            node.lcplr[1] = static_cast<uint16_t>(lcp(node.sa, sa[r], common));
+            func(i * 2, l, mid, node.lcplr[0], depth + 1, func);
+            func(i * 2 + 1, mid, r, node.lcplr[1], depth + 1, func);
+        };
+        walk(1, 0, n - 1, 0, 0, walk);
+    }
+
+    // Cut [0, n) into chunks run on pool, f(begin, end)
+    template<typename F>
+    static void ParallelChunks(ThreadPool * pool, int n, F && f) {
+        const size_t chunks = pool->size() == 0 ? 1 : (pool->size() + 1) * 4;
+        const int chunk_size = static_cast<int>((n + chunks - 1) / chunks);
+        pool->ParallelFor(chunks, [&f, chunk_size, n](size_t c) {
+            const int begin = static_cast<int>(c) * chunk_size;
+            f(begin, std::min(n, begin + chunk_size));
+        });
+    }
+
+    WriterCompress::~WriterCompress() {
+        if (flusher_.joinable()) {
+            {
+                std::lock_guard l(async_mutex_);
+                stop_ = true;
+            }
+            async_cv_.notify_one();
+            flusher_.join();
+        }
+    }
+
     size_t WriterCompress::Add(const char * data, size_t * n) {
         Slice s(data, *n);
         assert(kMaxVarint32Length * 2 + s.size() + sizeof(uint32_t) <= kBattlefieldSize);
         const size_t result = cursor_;
-        const size_t n_war_zone = result / kWarZoneSize;
-        const size_t war_zone_r = result % kWarZoneSize;
+        Drain();
+        PollIndexes();
+        const Slice & dat = Compressible(result) ? GenerateCompressed(s, &backup_)
+                                                 : GeneratePlain(s, &backup_);
+        helper_->Write(dat);
+        Account(dat);
+        *n = dat.size();
+        return result;
+    }
+
+    void WriterCompress::AddBatch(const Slice * records, size_t n, size_t * ids) {
+        Drain();
+        batch_.clear();
+        for (size_t i = 0; i < n; ++i) {
+            const Slice & s = records[i];
+            assert(kMaxVarint32Length * 2 + s.size() + sizeof(uint32_t) <= kBattlefieldSize);
+            ids[i] = cursor_;
+            // cheap unless a build is pending, a long batch must not miss indexes that became ready
+            PollIndexes();
+            const Slice & dat = Compressible(cursor_) ? GenerateCompressed(s, &backup_)
+                                                      : GeneratePlain(s, &backup_);
+            batch_.append(dat.data(), dat.size());
+            Account(dat);
+        }
+
+        try {
+            helper_->Write(batch_);
+        } catch (...) {
+            eptr_ = std::current_exception();
+            throw;
+        }
+    }
+
+    void WriterCompress::Drain() {
+        std::unique_lock l(async_mutex_, std::defer_lock);
+        if (flusher_.joinable()) {
+            // keep the log in order behind earlier AddAsync
+            l.lock();
+            if (std::this_thread::get_id() == flusher_.get_id()) {
+                // called back from a callback, nobody else writes pending_ meanwhile
+                while (!pending_.empty()) {
+                    WritePending(l);
+                }
+            } else {
+                drained_cv_.wait(l, [&]() {
+                    return pending_.empty() && !flushing_;
+                });
+            }
+        }
+        if (eptr_ != nullptr) {
+            std::rethrow_exception(eptr_);
+        }
+    }
+
+    size_t WriterCompress::AddAsync(const char * data, size_t * n, Callback callback) {
+        Slice s(data, *n);
+        assert(kMaxVarint32Length * 2 + s.size() + sizeof(uint32_t) <= kBattlefieldSize);
+        const size_t result = cursor_;
+        PollIndexes();
+        const Slice & dat = Compressible(result) ? GenerateCompressed(s, &backup_)
+                                                 : GeneratePlain(s, &backup_);
+        {
+            std::lock_guard l(async_mutex_);
+            if (eptr_ != nullptr) {
+                std::rethrow_exception(eptr_);
+            }
+            if (!flusher_.joinable()) {
+                flusher_ = std::thread(&WriterCompress::Flush, this);
+            }
+            pending_.push_back({dat.ToString(), std::move(callback), nullptr});
+        }
+        async_cv_.notify_one();
+        Account(dat);
+        *n = dat.size();
+        return result;
+    }
+
+    void WriterCompress::Flush() {
+        std::unique_lock l(async_mutex_);
+        while (true) {
+            async_cv_.wait(l, [&]() {
+                return stop_ || !pending_.empty();
+            });
+            if (pending_.empty()) {
+                break;
+            }
+            WritePending(l);
+
+            // not flushing_ meanwhile, a callback that adds again drains pending_ itself, see Drain
+            while (!written_.empty()) {
+                std::vector<Pending> batch;
+                batch.swap(written_);
+                l.unlock();
+                for (Pending & p:batch) {
+                    p.callback(p.eptr);
+                }
+                batch.clear();
+                l.lock();
+            }
+        }
+    }
+
+    void WriterCompress::WritePending(std::unique_lock<std::mutex> & l) {
+        std::vector<Pending> batch;
+        batch.swap(pending_);
+        flushing_ = true;
+        std::exception_ptr eptr = eptr_;
+        l.unlock();
+
+        if (eptr == nullptr) {
+            std::vector<Slice> slices;
+            slices.reserve(batch.size());
+            for (const Pending & p:batch) {
+                slices.emplace_back(p.dat);
+            }
+            try {
+                helper_->WriteV(slices.data(), slices.size());
+            } catch (...) {
+                eptr = std::current_exception();
+            }
+        }
+
+        l.lock();
+        if (eptr_ == nullptr) {
+            eptr_ = eptr;
+        }
+        for (Pending & p:batch) {
+            p.eptr = eptr;
+            written_.emplace_back(std::move(p));
+        }
+        flushing_ = false;
+        drained_cv_.notify_all();
+    }
+
+    void WriterCompress::Account(const Slice & dat) {
+        const size_t n_war_zone = cursor_ / kWarZoneSize;
+        const size_t war_zone_r = cursor_ % kWarZoneSize;
         switch (n_war_zone) {
 
             case 0: {
+                // grown by doubling it would end up holding twice the war zone
+                if (war_zone_.empty()) {
+                    war_zone_.reserve(kWarZoneSize);
+                }
                 const size_t left = kWarZoneSize - war_zone_r;
-                const Slice & dat = GeneratePlain(s);
                 if (left > dat.size()) {
                     war_zone_.append(dat.data(), dat.size());
                 } else {
                     war_zone_.append(dat.data(), left);
-                    BuildSA(reinterpret_cast<unsigned char *>(war_zone_.data()),
-                            &war_zone_sa_, &lcp_, &war_zone_lcplr_, &war_zone_bloom_filter_,
-                            kMinRepeatWarZone, kWarZoneSize);
+                    war_zone_job_ = std::async(std::launch::async, BuildSA,
+                                               reinterpret_cast<const unsigned char *>(war_zone_.data()),
+                                               kMinRepeatWarZone, kWarZoneSize, compact_index_);
                     battlefield_.append(dat.data() + left, dat.size() - left);
-
-                    lcp_.clear();
-                    lcp_.shrink_to_fit();
                 }
-                Write(dat);
-                *n = dat.size();
                 break;
             }
 
@@ -62,64 +336,62 @@ namespace logream {
 
                     case 0: {
                         const size_t left = kBattlefieldSize - battlefield_r;
-                        const Slice & dat = GeneratePlain(s);
                         if (left > dat.size()) {
                             battlefield_.append(dat.data(), dat.size());
                         } else {
                             battlefield_.append(dat.data(), left);
-                            BuildSA(reinterpret_cast<unsigned char *>(battlefield_.data()),
-                                    &battlefield_sa_, &lcp_, &battlefield_lcplr_, &battlefield_bloom_filter_,
-                                    kMinRepeatBattlefield, kBattlefieldSize);
+                            battlefield_job_ = std::async(std::launch::async, BuildSA,
+                                                          reinterpret_cast<const unsigned char *>(battlefield_.data()),
+                                                          kMinRepeatBattlefield, kBattlefieldSize, compact_index_);
                         }
-                        Write(dat);
-                        *n = dat.size();
                         break;
                     }
 
                     default: {
                         const size_t left = kWarZoneSize - war_zone_r;
-                        const Slice & dat = GenerateCompressed(s);
                         if (left > dat.size()) {
                         } else {
+                            // the old battlefield build may still be reading battlefield_
+                            battlefield_job_ = {};
+                            battlefield_index_ = {};
                             battlefield_.clear();
                             battlefield_.append(dat.data() + left, dat.size() - left);
                         }
-                        Write(dat);
-                        *n = dat.size();
                         break;
                     }
                 }
                 break;
             }
         }
-        return result;
+        cursor_ += dat.size();
     }
 
-    Slice WriterCompress::GeneratePlain(const Slice & s) {
+    Slice WriterCompress::GeneratePlain(const Slice & s, std::string * dst) {
         size_t request = VarintLength(s.size()) + s.size() + sizeof(uint32_t);
-        backup_.resize(request);
+        dst->resize(request);
 
-        char * dst = EncodeVarint32(backup_.data(), static_cast<uint32_t>(s.size()));
-        memcpy(dst, s.data(), s.size());
-        dst += s.size();
+        char * d = EncodeVarint32(dst->data(), static_cast<uint32_t>(s.size()));
+        memcpy(d, s.data(), s.size());
+        d += s.size();
 
         uint32_t crc = crc32c::Mask(crc32c::Value(s.data(), s.size()));
-        memcpy(dst, &crc, sizeof(crc));
-        return backup_;
+        memcpy(d, &crc, sizeof(crc));
+        return *dst;
     }
 
-    Slice WriterCompress::GenerateCompressed(const Slice & s) {
+    Slice WriterCompress::GenerateCompressed(const Slice & s, std::string * dst) const {
         assert(war_zone_.size() == kWarZoneSize);
         assert(battlefield_.size() == kBattlefieldSize);
-        backup_.resize(kMaxVarint32Length);
+        std::string & backup = *dst;
+        backup.resize(kMaxVarint32Length);
 
         auto emit_mark = [&](Mark mark, size_t len) {
             assert(len > 0);
             if (len <= kInlineSize) {
-                backup_ += Uint8ToChar(mark + len);
+                backup += Uint8ToChar(mark + len);
             } else {
-                backup_ += Uint8ToChar(mark);
-                PutVarint32(&backup_, static_cast<uint32_t>(len));
+                backup += Uint8ToChar(mark);
+                PutVarint32(&backup, static_cast<uint32_t>(len));
             }
         };
 
@@ -133,21 +405,21 @@ namespace logream {
                 return;
             }
             emit_mark(kNormal, literal.size());
-            backup_.append(literal.data(), literal.size());
+            backup.append(literal.data(), literal.size());
             literal = {};
         };
 
         auto emit_war_zone = [&](size_t pos, size_t len) {
             emit_mark(kWarZone, len);
-            backup_.append(reinterpret_cast<char *>(&pos), 3);
+            backup.append(reinterpret_cast<char *>(&pos), 3);
         };
         auto emit_battlefield = [&](size_t pos, size_t len) {
             emit_mark(kBattlefield, len);
-            backup_.append(reinterpret_cast<char *>(&pos), 2);
+            backup.append(reinterpret_cast<char *>(&pos), 2);
         };
         auto emit_frontline = [&](size_t pos, size_t len) {
             emit_mark(kFrontline, len);
-            backup_.append(reinterpret_cast<char *>(&pos), 1);
+            backup.append(reinterpret_cast<char *>(&pos), 1);
         };
 
         size_t i = 0;
@@ -158,12 +430,10 @@ namespace logream {
                 break;
             }
 
-            auto[wz_pos, wz_len] = FindLongestRepeat(war_zone_.data(), war_zone_sa_,
-                                                     pattern, kMinRepeatWarZone, war_zone_lcplr_,
-                                                     war_zone_bloom_filter_);
-            auto[bf_pos, bf_len] = FindLongestRepeat(battlefield_.data(), battlefield_sa_,
-                                                     pattern, kMinRepeatBattlefield, battlefield_lcplr_,
-                                                     battlefield_bloom_filter_);
+            auto[wz_pos, wz_len] = FindLongestRepeat(war_zone_.data(), war_zone_index_,
+                                                     pattern, kMinRepeatWarZone);
+            auto[bf_pos, bf_len] = FindLongestRepeat(battlefield_.data(), battlefield_index_,
+                                                     pattern, kMinRepeatBattlefield);
             auto[fl_pos, fl_len] = FindLongestRepeat(s, i);
 
             std::array<ssize_t, 3> profit_arr{
@@ -207,57 +477,207 @@ namespace logream {
         }
         emit_literal();
 
-        size_t size = backup_.size() - kMaxVarint32Length;
+        size_t size = backup.size() - kMaxVarint32Length;
         int varint_size = VarintLength(size);
-        char * dst = &backup_[kMaxVarint32Length - varint_size];
-        EncodeVarint32(dst, static_cast<uint32_t>(size));
 
+        // append before taking d, the append may reallocate
         uint32_t crc = crc32c::Mask(crc32c::Value(s.data(), s.size()));
-        backup_.append(reinterpret_cast<char *>(&crc),
-                       reinterpret_cast<char *>(&crc + 1));
-        return {dst, varint_size + size + sizeof(crc)};
+        backup.append(reinterpret_cast<char *>(&crc),
+                      reinterpret_cast<char *>(&crc + 1));
+
+        char * d = &backup[kMaxVarint32Length - varint_size];
+        EncodeVarint32(d, static_cast<uint32_t>(size));
+        return {d, varint_size + size + sizeof(crc)};
+    }
+
+    size_t WriterCompressParallel::Add(const char * data, size_t * n) {
+        Writer w({data, *n});
+        assert(kMaxVarint32Length * 2 + w.s.size() + sizeof(uint32_t) <= kBattlefieldSize);
+        std::unique_lock l(mutex_);
+        writers_.emplace_back(&w);
+        w.cv.wait(l, [&]() {
+            return w.done || &w == writers_.front();
+        });
+
+        // follower
+        if (w.done) {
+            if (w.eptr != nullptr) {
+                std::rethrow_exception(w.eptr);
+            } else {
+                *n = w.len;
+                return w.pos;
+            }
+        }
+
+        // leader
+        group_.assign(writers_.cbegin(), writers_.cend());
+        Writer * last_writer = group_.back();
+        if (eptr_ == nullptr) {
+            mutex_.unlock();
+            std::exception_ptr eptr;
+            try {
+                WriteGroup();
+            } catch (...) {
+                eptr = std::current_exception();
+            }
+            mutex_.lock();
+            eptr_ = eptr;
+        }
+
+        while (true) {
+            Writer * ready = writers_.front();
+            writers_.pop_front();
+            ready->eptr = eptr_;
+            if (ready != &w) {
+                ready->done = true;
+                ready->cv.notify_one();
+            }
+            if (ready == last_writer) {
+                break;
+            }
+        }
+        if (!writers_.empty()) {
+            writers_.front()->cv.notify_one();
+        }
+
+        if (w.eptr != nullptr) {
+            std::rethrow_exception(w.eptr);
+        } else {
+            *n = w.len;
+            return w.pos;
+        }
     }
 
-    void WriterCompress::Write(const Slice & s) {
-        helper_->Write(s);
-        cursor_ += s.size();
+    void WriterCompressParallel::WriteGroup() {
+        if (bufs_.size() < group_.size()) {
+            bufs_.resize(group_.size());
+        }
+
+        PollIndexes();
+        // Compress against the current battlefield in parallel. A record that ends up in
+        // another war zone (only in huge groups) is re-encoded below
+        const bool speculated = Compressible(cursor_);
+        const size_t n_war_zone = cursor_ / kWarZoneSize;
+        if (speculated) {
+            pool_.ParallelFor(group_.size(), [this](size_t i) {
+                group_[i]->dat = GenerateCompressed(group_[i]->s, &bufs_[i]);
+            });
+        }
+
+        slices_.clear();
+        for (size_t i = 0; i < group_.size(); ++i) {
+            Writer * writer = group_[i];
+            if (!Compressible(cursor_)) {
+                writer->dat = GeneratePlain(writer->s, &bufs_[i]);
+            } else if (!speculated || cursor_ / kWarZoneSize != n_war_zone) {
+                PollIndexes();
+                writer->dat = GenerateCompressed(writer->s, &bufs_[i]);
+            }
+            writer->pos = cursor_;
+            writer->len = writer->dat.size();
+            slices_.emplace_back(writer->dat);
+            Account(writer->dat);
+        }
+        helper_->WriteV(slices_.data(), slices_.size());
     }
 
-    void WriterCompress::BuildSA(const unsigned char * src,
-                                 std::vector<int> * sa,
-                                 std::vector<int> * lcp, std::vector<int> * lcplr,
-                                 std::string * bloom_filter, size_t min_repeat,
-                                 size_t n) {
-        sa->resize(n);
-        divsufsort(src, sa->data(), static_cast<int>(n), 0);
-        BuildLCP(src, *sa, lcplr /* as inverse_sa */, lcp);
-        BuildLCPLR(*lcp, lcplr);
-        BuildBloomFilter(src, n, min_repeat, bloom_filter);
+    WriterCompress::Index
+    WriterCompress::BuildSA(const unsigned char * src, size_t min_repeat, size_t n, bool compact) {
+        // only the war zone is worth the threads, a battlefield is indexed in a few milliseconds
+        const size_t threads = n > kBattlefieldSize ? std::max(std::thread::hardware_concurrency(), 1u) : 1;
+
+        Index index;
+        index.n = n;
+        if (!compact) {
+            ThreadPool pool(threads - 1);
+            std::vector<int> lcp;
+            index.sa.resize(n);
+            divsufsort(src, index.sa.data(), static_cast<int>(n), static_cast<int>(threads));
+            BuildLCP(src, index.sa, &index.lcplr /* as scratch */, &lcp, &pool);
+            BuildLCPLR(lcp, &index.lcplr, &pool);
+            if (n > kBattlefieldSize) {
+                BuildJumpTable(src, PlainSA{index.sa.data()}, static_cast<int>(n), &index.jump);
+                BuildTopLevels(src, PlainSA{index.sa.data()}, static_cast<int>(n), kTopLevels, &index.top);
+            }
+        } else {
+            // divsufsort wants 4 bytes a suffix, they are packed in place and the tail handed back
+            auto * sa = static_cast<int *>(malloc(n * sizeof(int)));
+            if (sa == nullptr) {
+                throw std::bad_alloc();
+            }
+            index.packed_sa.reset(reinterpret_cast<unsigned char *>(sa));
+            divsufsort(src, sa, static_cast<int>(n), static_cast<int>(threads));
+            static_assert(kWarZoneSize <= 1 << 24);
+            for (size_t r = 0; r < n; ++r) {
+                const auto v = static_cast<uint32_t>(sa[r]);
+                memcpy(index.packed_sa.get() + r * 3, &v, 3);
+            }
+            // an mmap-ed block shrinks in place
+            void * packed = realloc(index.packed_sa.get(), n * 3 + 1 /* PackedSA loads 4 bytes */);
+            if (packed != nullptr) {
+                index.packed_sa.release();
+                index.packed_sa.reset(static_cast<unsigned char *>(packed));
+            }
+
+            if (n > kBattlefieldSize) {
+                const PackedSA packed_sa{index.packed_sa.get()};
+                BuildJumpTable(src, packed_sa, static_cast<int>(n), &index.jump);
+                BuildTopLevels(src, packed_sa, static_cast<int>(n), kTopLevels, &index.top);
+            }
+        }
+        BuildBloomFilter(src, n, min_repeat, &index.bloom_filter);
+        return index;
     }
 
-    // https://stackoverflow.com/questions/11373453/how-does-lcp-help-in-finding-the-number-of-occurrences-of-a-pattern
-    std::pair<size_t, size_t>
-    WriterCompress::FindLongestRepeat(const char * src, const std::vector<int> & sa,
-                                      const Slice & pattern,
-                                      size_t min_repeat,
-                                      const std::vector<int> & lcplr,
-                                      const std::string & bloom_filter) {
-        if (pattern.size() < min_repeat
-            || !BloomFilter().KeyMayMatch({pattern.data(), min_repeat}, bloom_filter)) {
-            return {{}, 0};
+    void WriterCompress::PollIndexes() {
+        Poll(&war_zone_job_, &war_zone_index_);
+        Poll(&battlefield_job_, &battlefield_index_);
+    }
+
+    void WriterCompress::Poll(std::future<Index> * job, Index * index) {
+        if (job->valid() && job->wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            *index = job->get();
         }
+    }
 
-        const auto n = static_cast<int>(sa.size());
+    size_t WriterCompress::Index::ApproximateMemoryUsage() const {
+        return sa.capacity() * sizeof(int) + lcplr.capacity() * sizeof(int)
+               + (packed_sa != nullptr ? n * 3 + 1 : 0)
+               + jump.capacity() * sizeof(int) + top.capacity() * sizeof(TopLine) + bloom_filter.capacity();
+    }
+
+    size_t WriterCompress::ApproximateMemoryUsage() const {
+        return war_zone_.capacity() + war_zone_index_.ApproximateMemoryUsage()
+               + battlefield_.capacity() + battlefield_index_.ApproximateMemoryUsage();
+    }
+
+    // https://stackoverflow.com/questions/11373453/how-does-lcp-help-in-finding-the-number-of-occurrences-of-a-pattern
+    // lcplr is null for a compact index, below the top levels each compare then skips what both bounds share
+    template<typename SA, typename LCPLR, typename Line>
+    static std::pair<size_t, size_t> SearchIndex(const char * src, const SA & sa, const LCPLR * lcplr,
+                                                 const std::vector<int> & jump, const std::vector<Line> & top,
+                                                 int n, const Slice & pattern) {
         const auto m = static_cast<int>(pattern.size());
+        const auto top_nodes = static_cast<int>(top.size() * 4);
 
         auto grow = false;
-        auto compare_to = [src, &sa, &pattern, n, m, &grow](int num, int start) -> int {
-            assert(Slice(src + sa[num], start) == Slice(pattern.data(), start));
-            auto i = sa[num] + start;
+        auto compare_to = [src, &pattern, n, m, &grow](int from, int start) -> int {
+            assert(Slice(src + from, start) == Slice(pattern.data(), start));
+            auto i = from + start;
             for (; i < n && start < m && src[i] == pattern[start]; ++i, ++start) {}
             grow = (i < n ? CharToUint8(src[i]) : 0) < (start < m ? CharToUint8(pattern[start]) : 0);
             return start;
         };
+        // settled within the prefix a top node keeps, the suffix itself is only read past it
+        auto compare_to_node = [&pattern, n, m, &grow, &compare_to](const auto & node, int start) -> int {
+            const int limit = std::min({static_cast<int>(sizeof(node.prefix)), m, n - node.sa});
+            for (; start < limit && node.prefix[start] == pattern[start]; ++start) {}
+            if (start >= limit) {
+                return compare_to(node.sa, start);
+            }
+            grow = CharToUint8(node.prefix[start]) < CharToUint8(pattern[start]);
+            return start;
+        };
 
         auto i = 1;
         struct {
@@ -267,6 +687,30 @@ namespace logream {
         auto commons = 0;
         auto matches = 0;
 
+        if (!jump.empty()) {
+            assert(m >= 2);
+            const int key = CharToUint8(pattern[0]) << 8 | CharToUint8(pattern[1]);
+            const int begin = jump[key];
+            const int end = jump[key + 1] - 1;
+            if (begin > end) {
+                return {{}, 0};
+            }
+            // the best match is among [begin, end], nodes that do not split it are passed without touching the text
+            // the search then starts over at the node that does, its bounds need no LCP with the pattern
+            while (lr.r - lr.l > 2) {
+                const auto mid = (lr.l + lr.r) / 2;
+                if (end <= mid) {
+                    lr.r = mid;
+                    i = i * 2;
+                } else if (begin >= mid) {
+                    lr.l = mid;
+                    i = i * 2 + 1;
+                } else {
+                    break;
+                }
+            }
+        }
+
         while (true) {
             auto mid = (lr.l + lr.r) / 2;
             if (commons > matches) {
@@ -307,13 +751,17 @@ namespace logream {
                 i = i * 2 + (!grow);
             } else {
 
-                LOGREAM_PREFETCH(&sa[mid], 0, 1);
-                LOGREAM_PREFETCH(pattern.data() + matches, 0, 1);
-                LOGREAM_PREFETCH (src + sa[mid] + matches, 0, 1);
-
                 // L ... M ... R
                 //       |
-                matches = compare_to(mid, matches);
+                if (i < top_nodes) {
+                    matches = compare_to_node(top[i / 4].nodes[i % 4], matches);
+                } else {
+                    LOGREAM_PREFETCH(sa.address(mid), 0, 1);
+                    LOGREAM_PREFETCH(pattern.data() + matches, 0, 1);
+                    LOGREAM_PREFETCH (src + sa[mid] + matches, 0, 1);
+
+                    matches = compare_to(sa[mid], matches);
+                }
                 /*
                 if (grow) {
                     lr.l = mid;
@@ -333,9 +781,13 @@ namespace logream {
                 i = i * 2 + grow;
             }
 
-            LOGREAM_PREFETCH(&lcplr[i * 2], 0, 1);
+            if (i < top_nodes / 4) {
+                LOGREAM_PREFETCH(&top[i], 0, 1);
+            } else if (lcplr != nullptr) {
+                LOGREAM_PREFETCH(&lcplr[i * 2], 0, 1);
+            }
 
-            if (lr.r - lr.l <= 2) {
+            if (lr.r - lr.l <= 2 || (lcplr == nullptr && i >= top_nodes)) {
                 break;
             }
             /*
@@ -345,7 +797,22 @@ namespace logream {
                 commons = lcplr[i * 2 + 1];
             }
             */
-            commons = lcplr[i * 2 + (!grow)];
+            commons = i < top_nodes ? top[i / 4].nodes[i % 4].lcplr[!grow] : lcplr[i * 2 + (!grow)];
+        }
+
+        // once both bounds are compared here, sa[l] < pattern <= sa[r] and every suffix between shares the lesser match
+        for (int l_matches = 0, r_matches = 0; lr.r - lr.l > 2;) {
+            const auto mid = (lr.l + lr.r) / 2;
+            LOGREAM_PREFETCH(sa.address((lr.l + mid) / 2), 0, 1);
+            LOGREAM_PREFETCH(sa.address((mid + lr.r) / 2), 0, 1);
+            const int matched = compare_to(sa[mid], std::min(l_matches, r_matches));
+            if (grow) {
+                lr.l = mid;
+                l_matches = matched;
+            } else {
+                lr.r = mid;
+                r_matches = matched;
+            }
         }
 
         size_t pos = 0;
@@ -364,6 +831,25 @@ namespace logream {
         return {pos, len};
     }
 
+    std::pair<size_t, size_t>
+    WriterCompress::FindLongestRepeat(const char * src, const Index & index,
+                                      const Slice & pattern,
+                                      size_t min_repeat) {
+        if (index.n == 0 /* not built yet */ || pattern.size() < min_repeat
+            || !BloomFilter().KeyMayMatch({pattern.data(), min_repeat}, index.bloom_filter)) {
+            return {{}, 0};
+        }
+
+        const auto n = static_cast<int>(index.n);
+        // records are shorter than 64KB, a match never gets to where the top nodes clamp their lcplr
+        assert(pattern.size() < UINT16_MAX);
+        if (index.packed_sa != nullptr) {
+            return SearchIndex(src, PackedSA{index.packed_sa.get()}, static_cast<const int *>(nullptr), index.jump,
+                               index.top, n, pattern);
+        }
+        return SearchIndex(src, PlainSA{index.sa.data()}, index.lcplr.data(), index.jump, index.top, n, pattern);
+    }
+
     std::pair<size_t, size_t>
     WriterCompress::FindLongestRepeat(const Slice & s, size_t before) {
         const char * target = s.data() + before;
@@ -383,38 +869,51 @@ namespace logream {
 
     // Kasai's Algorithm
     // https://www.geeksforgeeks.org/%C2%AD%C2%ADkasais-algorithm-for-construction-of-lcp-array-from-suffix-array/
+    // Kasai's algorithm in the PHI form: in text order, the LCP with the next suffix in sa drops by at most 1 a step
+    // Text is cut into chunks that each start over from 0, so they run in parallel
     void WriterCompress::BuildLCP(const unsigned char * src, const std::vector<int> & sa,
-                                  std::vector<int> * inverse_sa, std::vector<int> * lcp) {
-        std::vector<int> & isa = *inverse_sa;
-        std::vector<int> & lcp_arr = *lcp;
-
-        isa.resize(sa.size());
-        for (int i = 0; i < sa.size(); ++i) {
-            isa[sa[i]] = i;
-        }
-
-        int p = 0;
-        lcp_arr.resize(sa.size());
-        for (int i = 0; i < sa.size(); ++i) {
-            if (isa[i] == (sa.size() - 1)) {
-                p = 0;
-                lcp_arr.back() = INT_MAX;
-                continue;
+                                  std::vector<int> * scratch, std::vector<int> * lcp, ThreadPool * pool) {
+        const auto n = static_cast<int>(sa.size());
+        std::vector<int> & phi = *scratch; // the suffix after each suffix in sa, -1 for the last
+        std::vector<int> & plcp = *lcp;    // by text position, by rank once done
+        phi.resize(sa.size());
+        plcp.resize(sa.size());
+
+        ParallelChunks(pool, n, [&](int begin, int end) {
+            for (int r = begin; r < end; ++r) {
+                phi[sa[r]] = r + 1 < n ? sa[r + 1] : -1;
             }
+        });
+        ParallelChunks(pool, n, [&](int begin, int end) {
+            int p = 0;
+            for (int i = begin; i < end; ++i) {
+                const int j = phi[i];
+                if (j < 0) {
+                    p = 0;
+                    plcp[i] = INT_MAX;
+                    continue;
+                }
 
-            int j = sa[isa[i] + 1];
-            while (i + p < sa.size() && j + p < sa.size() && src[i + p] == src[j + p]) {
-                ++p;
-            }
+                while (i + p < n && j + p < n && src[i + p] == src[j + p]) {
+                    ++p;
+                }
 
-            lcp_arr[isa[i]] = p;
-            if (p > 0) {
-                --p;
+                plcp[i] = p;
+                if (p > 0) {
+                    --p;
+                }
             }
-        }
+        });
+        // into rank order, phi is done with
+        ParallelChunks(pool, n, [&](int begin, int end) {
+            for (int r = begin; r < end; ++r) {
+                phi[r] = plcp[sa[r]];
+            }
+        });
+        plcp.swap(phi);
     }
 
-    void WriterCompress::BuildLCPLR(const std::vector<int> & lcp, std::vector<int> * lcplr) {
+    void WriterCompress::BuildLCPLR(const std::vector<int> & lcp, std::vector<int> * lcplr, ThreadPool * pool) {
         std::vector<int> & lcp_lr = *lcplr;
 
         auto build = [&lcp, &lcp_lr](int i, int l, int r, auto && func) -> std::pair<int, int> {
@@ -452,7 +951,48 @@ namespace logream {
         };
 
         lcp_lr.resize(lcp.size());
-        build(1, 0, static_cast<int>(lcp.size()) - 1, build);
+
+        // the subtrees split_depth levels down are built in parallel, the levels above join their results
+        int split_depth = 0;
+        while ((size_t(1) << split_depth) < (pool->size() == 0 ? 1 : (pool->size() + 1) * 8)) {
+            ++split_depth;
+        }
+        struct Subtree {
+            int i, l, r;
+            std::pair<int, int> result;
+        };
+        std::vector<Subtree> subtrees;
+        auto split = [&subtrees, split_depth](int i, int l, int r, int depth, auto && func) -> void {
+            if (depth == split_depth || r - l <= 2) {
+                subtrees.push_back({i, l, r, {}});
+                return;
+            }
+            int m = (l + r) / 2;
+            func(i * 2, l, m, depth + 1, func);
+            func(i * 2 + 1, m, r, depth + 1, func);
+        };
+        split(1, 0, static_cast<int>(lcp.size()) - 1, 0, split);
+
+        pool->ParallelFor(subtrees.size(), [&subtrees, &build](size_t k) {
+            Subtree & subtree = subtrees[k];
+            subtree.result = build(subtree.i, subtree.l, subtree.r, build);
+        });
+
+        // same walk as split, subtrees come back in the order it found them
+        size_t next = 0;
+        auto join = [&lcp_lr, &subtrees, &next, split_depth](int i, int l, int r, int depth,
+                                                            auto && func) -> std::pair<int, int> {
+            if (depth == split_depth || r - l <= 2) {
+                return subtrees[next++].result;
+            }
+            int m = (l + r) / 2;
+            auto a = func(i * 2, l, m, depth + 1, func);
+            auto b = func(i * 2 + 1, m, r, depth + 1, func);
+            int common_prefix = std::min(a.second, b.first);
+            lcp_lr[i] = common_prefix;
+            return {common_prefix, std::min(a.second, b.second)};
+        };
+        join(1, 0, static_cast<int>(lcp.size()) - 1, 0, join);
     }
 
     void WriterCompress::BuildBloomFilter(const unsigned char * src, size_t n, size_t min_repeat,
@@ -468,118 +1008,319 @@ namespace logream {
         }, n, bloom_filter);
     }
 
+    class ReaderCompress::IteratorImpl : public FrameIterator {
+    private:
+        const ReaderCompress * const reader_;
+        std::string scratch_;
+        References refs_;
+        size_t n_war_zone_ = 0;
+
+    public:
+        IteratorImpl(const ReaderCompress * reader, size_t end)
+                : FrameIterator(reader->helper_, end),
+                  reader_(reader) {
+            refs_.war_zone = true;
+            refs_.battlefield = true;
+        }
+
+    protected:
+        bool Expand(size_t id, const Slice & payload, uint32_t crc, Slice * record) override {
+            if (Plain(id)) {
+                *record = payload;
+                return crc32c::Value(payload.data(), payload.size()) == crc;
+            }
+            if (id / kWarZoneSize != n_war_zone_) {
+                n_war_zone_ = id / kWarZoneSize;
+                refs_.battlefield_data = nullptr;
+            }
+            scratch_.clear();
+            if (!reader_->Expand(id, payload, crc, true, &scratch_, &refs_)) {
+                return false;
+            }
+            *record = scratch_;
+            return true;
+        }
+    };
+
     size_t ReaderCompress::Get(size_t id, std::string * s) const {
-        auto & b = const_cast<std::string &>(backup_);
-        b.resize(kMaxVarint32Length);
-        helper_->ReadAt(id, kMaxVarint32Length, b.data());
-        Slice buf(b);
+        References refs;
+        refs.war_zone = refs.battlefield = cache_references_;
+        return Decode(helper_, id, s, &refs);
+    }
+
+    size_t ReaderCompress::GetView(size_t id, Slice * record, std::string * scratch) const {
+        if (!Plain(id) || helper_->View(id, kMaxVarint32Length) == nullptr) {
+            return Reader::GetView(id, record, scratch);
+        }
+        Slice payload;
+        uint32_t crc;
+        const size_t next = ViewFrame(helper_, id, &payload, &crc);
+        if (next == 0 || (Sample(verify_every_, &sampled_) && crc32c::Value(payload.data(), payload.size()) != crc)) {
+            return 0;
+        }
+        *record = payload;
+        return next;
+    }
+
+    void ReaderCompress::MultiGet(const size_t * ids, size_t n, std::string * s, size_t * results) const {
+        // ids come in offset order, so one battlefield at a time
+        References refs;
+        refs.war_zone = cache_references_;
+        refs.battlefield = true;
+        size_t n_war_zone = 0;
+        CoalescedMultiGet(helper_, read_window_ != 0 ? read_window_ : kDefaultReadWindow, ids, n,
+                          [&](const Helper * helper, size_t i) {
+                              if (ids[i] / kWarZoneSize != n_war_zone) {
+                                  n_war_zone = ids[i] / kWarZoneSize;
+                                  refs.battlefield_data = nullptr;
+                              }
+                              results[i] = Decode(helper, ids[i], &s[i], &refs);
+                          });
+    }
+
+    std::unique_ptr<Reader::Iterator> ReaderCompress::NewIterator(size_t end) const {
+        return std::make_unique<IteratorImpl>(this, end);
+    }
+
+    size_t ReaderCompress::Decode(const Helper * helper, size_t id, std::string * s, References * refs) const {
+        // the frame, the output is built in *s
+        thread_local std::string b;
+        size_t got = 0;
+        if (read_window_ > kMaxVarint32Length) {
+            b.resize(read_window_);
+            got = helper->ReadAtMost(id, read_window_, b.data());
+        }
+        if (got == 0) {
+            got = kMaxVarint32Length;
+            b.resize(got);
+            helper->ReadAt(id, got, b.data());
+        }
+
+        Slice buf(b.data(), got);
         uint32_t size;
         if (!GetVarint32(&buf, &size)) {
             return 0;
         }
 
-        const size_t varint_size = b.size() - buf.size();
+        const size_t varint_size = got - buf.size();
         const size_t data_size = varint_size + size;
         const size_t read_size = data_size + sizeof(uint32_t);
         b.resize(read_size);
-        helper_->ReadAt(id + kMaxVarint32Length,
-                        read_size - kMaxVarint32Length,
-                        &b[kMaxVarint32Length]);
+        // the record is larger than what has been read
+        if (read_size > got) {
+            helper->ReadAt(id + got, read_size - got, &b[got]);
+        }
 
         uint32_t crc;
         memcpy(&crc, &b[data_size], sizeof(crc));
         crc = crc32c::Unmask(crc);
         buf = {&b[varint_size], size};
 
-        auto read_plain = [&]() -> size_t {
-            if (crc32c::Value(buf.data(), buf.size()) != crc) {
+        const bool verify = Sample(verify_every_, &sampled_);
+        if (Plain(id)) {
+            if (verify && crc32c::Value(buf.data(), buf.size()) != crc) {
                 return 0;
             }
             s->append(buf.data(), buf.size());
             return id + read_size;
-        };
+        }
+        return Expand(id, buf, crc, verify, s, refs) ? id + read_size : 0;
+    }
 
-        auto read_compressed = [&](size_t battlefield_pos) -> size_t {
-            const size_t dst_size = s->size();
-            const char * p = buf.data();
-            const char * limit = p + buf.size();
-            while (p != limit) {
-
-                auto mark = CharToUint8(*p++);
-                if (mark >= kNormal && mark <= kNormalClose) {
-                    uint32_t len = mark - kNormal;
-#define LOAD_LEN()                                         \
-                    if (len == 0) {                        \
-                        Slice cursor(p, limit - p);        \
-                        if (!GetVarint32(&cursor, &len)) { \
-                            return 0;                      \
-                        }                                  \
-                        p = cursor.data();                 \
-                    }
-                    LOAD_LEN();
+    bool ReaderCompress::Expand(size_t id, const Slice & payload, uint32_t crc, bool verify, std::string * s,
+                                References * refs) const {
+        const size_t battlefield_pos = id - id % kWarZoneSize;
+        const char * p = payload.data();
+        const char * limit = p + payload.size();
+        size_t size;
+        if (!ExpandedSize(p, limit, &size)) {
+            return false;
+        }
 
-                    s->append(p, len);
+        // sized once, the tail is room for CopyMatch to overrun into
+        const size_t dst_size = s->size();
+        s->resize(dst_size + size + kCopyMatchSlack);
+        char * const begin = s->data() + dst_size;
+        char * out = begin;
+        // cached references, once the first load has brought them in
+        const char * war_zone = nullptr;
+        const char * battlefield = nullptr;
+        while (p != limit) {
+            const MarkInfo & info = kMarkTable[CharToUint8(*p++)];
+            uint32_t len = info.len;
+            if (len == 0) {
+                p = GetVarint32(p, limit, &len);
+            }
+            // ExpandedSize checked pos_size bytes remain and the reference bounds
+            // the crc behind the payload covers the rest of the load
+            uint32_t pos;
+            memcpy(&pos, p, sizeof(pos));
+            pos &= info.pos_mask;
+            p += info.pos_size;
+
+            switch (info.kind) {
+                case MarkInfo::kLiteral:
+                    memcpy(out, p, len);
                     p += len;
-                } else {
-                    uint32_t len = 0;
-                    uint32_t pos = 0;
-
-                    if (mark >= kWarZone && mark <= kWarZoneClose) {
-                        len = mark - kWarZone;
-                        LOAD_LEN();
-#define LOAD_POS(n)                           \
-                        memcpy(&pos, p, (n)); \
-                        p += (n);
-                        LOAD_POS(3);
-#define LOAD_DAT(o)                                                     \
-                        size_t i = s->size();                           \
-                        s->resize(i + len);                             \
-                        helper_->ReadAt(pos + (o), len, s->data() + i);
-                        LOAD_DAT(0);
-                    } else if (mark >= kBattlefield && mark <= kBattlefieldClose) {
-                        len = mark - kBattlefield;
-                        LOAD_LEN();
-                        LOAD_POS(2);
-                        LOAD_DAT(battlefield_pos);
+                    break;
+                case MarkInfo::kWarZoneRef:
+                    if (war_zone != nullptr) {
+                        memcpy(out, war_zone + pos, len);
                     } else {
-                        assert(mark >= kFrontline && mark <= kFrontlineClose);
-                        len = mark - kFrontline;
-                        LOAD_LEN();
-                        LOAD_POS(1);
-
-                        size_t idx = s->size() - (pos + 1);
-                        for (size_t i = 0; i < len; ++i) {
-                            (*s) += (*s)[idx++];
+                        LoadReference(0, pos, len, out, refs);
+                        if (refs->war_zone) {
+                            war_zone = refs->war_zone_data->data();
                         }
                     }
-                }
-#undef LOAD_LEN
-#undef LOAD_POS
-#undef LOAD_DAT
+                    break;
+                case MarkInfo::kBattlefieldRef:
+                    if (battlefield != nullptr) {
+                        memcpy(out, battlefield + pos, len);
+                    } else {
+                        LoadReference(battlefield_pos, pos, len, out, refs);
+                        if (refs->battlefield) {
+                            battlefield = refs->battlefield_data->data();
+                        }
+                    }
+                    break;
+                case MarkInfo::kFrontlineRef:
+                    // a match never reaches before the record
+                    if (pos + 1 > static_cast<size_t>(out - begin)) {
+                        s->resize(dst_size);
+                        return false;
+                    }
+                    CopyMatch(out, pos + 1, len);
+                    break;
             }
+            out += len;
+        }
+        assert(out == begin + size);
 
-            if (crc32c::Value(s->data() + dst_size, s->size() - dst_size) != crc) {
-                return 0;
+        if (verify && crc32c::Value(begin, size) != crc) {
+            s->resize(dst_size);
+            return false;
+        }
+        s->resize(dst_size + size);
+        return true;
+    }
+
+    bool ReaderCompress::ExpandedSize(const char * p, const char * limit, size_t * size) {
+        size_t n = 0;
+        while (p != limit) {
+            const MarkInfo & info = kMarkTable[CharToUint8(*p++)];
+            uint32_t len = info.len;
+            if (len == 0 && (p = GetVarint32(p, limit, &len)) == nullptr) {
+                return false;
             }
-            return id + read_size;
+
+            const size_t skip = info.pos_size + (info.kind == MarkInfo::kLiteral ? len : 0);
+            if (skip > static_cast<size_t>(limit - p)) {
+                return false;
+            }
+            // the same 4-byte load as Expand, a reference must stay inside what it points into
+            uint32_t pos;
+            memcpy(&pos, p, sizeof(pos));
+            pos &= info.pos_mask;
+            if ((info.kind == MarkInfo::kWarZoneRef && pos + static_cast<size_t>(len) > kWarZoneSize) ||
+                (info.kind == MarkInfo::kBattlefieldRef && pos + static_cast<size_t>(len) > kBattlefieldSize)) {
+                return false;
+            }
+            p += skip;
+            n += len;
+            // a record is shorter than a battlefield, a corrupt length must not size the output past that
+            if (n > kBattlefieldSize) {
+                return false;
+            }
+        }
+        *size = n;
+        return true;
+    }
+
+    void ReaderCompress::CopyMatch(char * dst, size_t offset, size_t len) {
+        const char * src = dst - offset;
+        char * const end = dst + len;
+        // short offsets: double the pattern with plain copies until it spans a vector
+        while (static_cast<size_t>(dst - src) < 16) {
+            if (dst >= end) {
+                return;
+            }
+            const size_t n = std::min(static_cast<size_t>(dst - src), static_cast<size_t>(end - dst));
+            memcpy(dst, src, n);
+            dst += n;
+        }
+        // src trails dst by at least 16, each store only reads bytes already written
+        while (dst < end) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                             _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+            src += 16;
+            dst += 16;
+        }
+    }
+
+    void ReaderCompress::LoadReference(size_t battlefield_pos, size_t pos, size_t len, char * dst,
+                                       References * refs) const {
+        const std::string * src;
+        if (battlefield_pos == 0) {
+            if (!refs->war_zone) {
+                helper_->ReadAt(pos, len, dst);
+                return;
+            }
+            if (refs->war_zone_data == nullptr) {
+                refs->war_zone_data = LoadWarZone();
+            }
+            src = refs->war_zone_data.get();
+        } else {
+            if (!refs->battlefield) {
+                helper_->ReadAt(battlefield_pos + pos, len, dst);
+                return;
+            }
+            if (refs->battlefield_data == nullptr) {
+                refs->battlefield_data = LoadBattlefield(battlefield_pos);
+            }
+            src = refs->battlefield_data.get();
+        }
+        assert(pos + len <= src->size());
+        memcpy(dst, src->data() + pos, len);
+    }
+
+    std::shared_ptr<const std::string> ReaderCompress::LoadWarZone() const {
+        auto load = [this]() {
+            auto data = std::make_shared<std::string>(kWarZoneSize, 0);
+            helper_->ReadAt(0, kWarZoneSize, data->data());
+            return data;
         };
+        if (!cache_references_) {
+            return load();
+        }
 
-        const size_t n_war_zone = id / kWarZoneSize;
-        const size_t war_zone_r = id % kWarZoneSize;
-        switch (n_war_zone) {
-            case 0:
-                return read_plain();
+        // a failed read leaves the flag unset, the next reference retries
+        std::call_once(war_zone_once_, [this, &load]() {
+            war_zone_ = load();
+        });
+        return war_zone_;
+    }
 
-            default: {
-                const size_t n_battlefield = war_zone_r / kBattlefieldSize;
-                switch (n_battlefield) {
-                    case 0:
-                        return read_plain();
+    std::shared_ptr<const std::string> ReaderCompress::LoadBattlefield(size_t battlefield_pos) const {
+        if (!cache_references_) {
+            auto data = std::make_shared<std::string>(kBattlefieldSize, 0);
+            helper_->ReadAt(battlefield_pos, kBattlefieldSize, data->data());
+            return data;
+        }
 
-                    default:
-                        return read_compressed(id - war_zone_r);
-                }
+        Battlefield & slot = battlefields_[battlefield_pos / kWarZoneSize % kBattlefieldSlots];
+        {
+            std::lock_guard l(mutex_);
+            if (slot.pos == battlefield_pos) {
+                return slot.data;
             }
         }
+
+        // read without the lock, racing readers may load the same battlefield twice
+        auto data = std::make_shared<std::string>(kBattlefieldSize, 0);
+        helper_->ReadAt(battlefield_pos, kBattlefieldSize, data->data());
+        std::lock_guard l(mutex_);
+        slot.pos = battlefield_pos;
+        slot.data = data;
+        return data;
     }
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "logream_file.h"
+
+namespace logream {
+    [[noreturn]] static void ThrowErrno(const char * what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    FileWriterHelper::FileWriterHelper(const std::string & path)
+            : fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) {
+        if (fd_ < 0) {
+            ThrowErrno("open");
+        }
+    }
+
+    FileWriterHelper::~FileWriterHelper() {
+        close(fd_);
+    }
+
+    void FileWriterHelper::Write(const Slice & s) {
+        WriteV(&s, 1);
+    }
+
+    void FileWriterHelper::WriteV(const Slice * slices, size_t n) {
+        constexpr size_t kBatch = 64;
+        iovec iov[kBatch];
+        while (n != 0) {
+            size_t cnt = std::min(n, kBatch);
+            for (size_t i = 0; i < cnt; ++i) {
+                iov[i].iov_base = const_cast<char *>(slices[i].data());
+                iov[i].iov_len = slices[i].size();
+            }
+            slices += cnt;
+            n -= cnt;
+
+            iovec * p = iov;
+            while (cnt != 0) {
+                ssize_t r = writev(fd_, p, static_cast<int>(cnt));
+                if (r < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    ThrowErrno("writev");
+                }
+
+                // short write, skip what has been written
+                auto written = static_cast<size_t>(r);
+                while (cnt != 0 && written >= p->iov_len) {
+                    written -= p->iov_len;
+                    ++p;
+                    --cnt;
+                }
+                if (cnt != 0) {
+                    p->iov_base = static_cast<char *>(p->iov_base) + written;
+                    p->iov_len -= written;
+                }
+            }
+        }
+    }
+
+    size_t FileWriterHelper::size() const {
+        struct stat st{};
+        if (fstat(fd_, &st) != 0) {
+            ThrowErrno("fstat");
+        }
+        return static_cast<size_t>(st.st_size);
+    }
+
+    FileReaderHelper::FileReaderHelper(const std::string & path)
+            : fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+        if (fd_ < 0) {
+            ThrowErrno("open");
+        }
+    }
+
+    FileReaderHelper::~FileReaderHelper() {
+        close(fd_);
+    }
+
+    void FileReaderHelper::ReadAt(size_t offset, size_t n, char * scratch) const {
+        if (ReadAtMost(offset, n, scratch) != n) {
+            throw std::system_error(std::make_error_code(std::errc::io_error), "pread: unexpected end of file");
+        }
+    }
+
+    size_t FileReaderHelper::ReadAtMost(size_t offset, size_t n, char * scratch) const {
+        size_t done = 0;
+        while (done != n) {
+            ssize_t r = pread(fd_, scratch + done, n - done, static_cast<off_t>(offset + done));
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ThrowErrno("pread");
+            }
+            if (r == 0) {
+                break;
+            }
+            done += static_cast<size_t>(r);
+        }
+        return done;
+    }
+
+    MmapReaderHelper::MmapReaderHelper(const std::string & path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ThrowErrno("open");
+        }
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            int e = errno;
+            close(fd);
+            errno = e;
+            ThrowErrno("fstat");
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        // an empty file cannot be mapped, there is nothing to read either
+        if (size_ != 0) {
+            void * p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                int e = errno;
+                close(fd);
+                errno = e;
+                ThrowErrno("mmap");
+            }
+            data_ = static_cast<const char *>(p);
+        }
+        // the mapping outlives the descriptor
+        close(fd);
+    }
+
+    MmapReaderHelper::~MmapReaderHelper() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    void MmapReaderHelper::ReadAt(size_t offset, size_t n, char * scratch) const {
+        const char * p = View(offset, n);
+        if (p == nullptr) {
+            throw std::system_error(std::make_error_code(std::errc::io_error), "mmap: read past the mapping");
+        }
+        memcpy(scratch, p, n);
+    }
+
+    size_t MmapReaderHelper::ReadAtMost(size_t offset, size_t n, char * scratch) const {
+        if (offset >= size_) {
+            return 0;
+        }
+        n = std::min(n, size_ - offset);
+        memcpy(scratch, data_ + offset, n);
+        return n;
+    }
+
+    const char * MmapReaderHelper::View(size_t offset, size_t n) const {
+        if (offset > size_ || n > size_ - offset) {
+            return nullptr;
+        }
+        return data_ + offset;
+    }
+}
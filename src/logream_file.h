@@ -0,0 +1,88 @@
+#pragma once
+#ifndef LOGREAM_LOGREAM_FILE_H
+#define LOGREAM_LOGREAM_FILE_H
+
+/*
+ * 基于 POSIX 文件的 Helper 实现
+ * 读取以 pread 进行, 支持 ReadAtMost, 越过文件末尾的 ReadAt 视为错误
+ * MmapReaderHelper 映射打开时的整个文件, 支持 View, GetView 可直接返回映射内的记录
+ *
+ * 出错时抛出 std::system_error
+ */
+
+#include "logream.h"
+
+namespace logream {
+    class FileWriterHelper : public Writer::Helper {
+    private:
+        int fd_;
+
+    public:
+        // Open path for appending, create it if missing
+        explicit FileWriterHelper(const std::string & path);
+
+        FileWriterHelper(const FileWriterHelper &) = delete;
+
+        FileWriterHelper & operator=(const FileWriterHelper &) = delete;
+
+        ~FileWriterHelper() override;
+
+    public:
+        void Write(const Slice & s) override;
+
+        // writev(2), no user space copy
+        void WriteV(const Slice * slices, size_t n) override;
+
+        // current file size, i.e. the cursor to open a writer at
+        size_t size() const;
+    };
+
+    class FileReaderHelper : public Reader::Helper {
+    private:
+        int fd_;
+
+    public:
+        explicit FileReaderHelper(const std::string & path);
+
+        FileReaderHelper(const FileReaderHelper &) = delete;
+
+        FileReaderHelper & operator=(const FileReaderHelper &) = delete;
+
+        ~FileReaderHelper() override;
+
+    public:
+        // pread(2), safe to call concurrently
+        void ReadAt(size_t offset, size_t n, char * scratch) const override;
+
+        size_t ReadAtMost(size_t offset, size_t n, char * scratch) const override;
+    };
+
+    class MmapReaderHelper : public Reader::Helper {
+    private:
+        const char * data_ = nullptr;
+        size_t size_ = 0;
+
+    public:
+        // Map path read-only, as large as it is now
+        explicit MmapReaderHelper(const std::string & path);
+
+        MmapReaderHelper(const MmapReaderHelper &) = delete;
+
+        MmapReaderHelper & operator=(const MmapReaderHelper &) = delete;
+
+        ~MmapReaderHelper() override;
+
+    public:
+        void ReadAt(size_t offset, size_t n, char * scratch) const override;
+
+        size_t ReadAtMost(size_t offset, size_t n, char * scratch) const override;
+
+        const char * View(size_t offset, size_t n) const override;
+
+        size_t size() const {
+            return size_;
+        }
+    };
+}
+
+#endif //LOGREAM_LOGREAM_FILE_H
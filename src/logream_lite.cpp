@@ -1,110 +1,460 @@
-#include "coding.h"
+#include <algorithm>
+#include <thread>
+
 #include "crc32c.h"
+#include "frame_iterator.h"
 #include "logream_lite.h"
+#include "multi_get.h"
 
 namespace logream {
+    static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Encode records[0, n) back to back, offsets[i] receives the offset of records[i] within dst
+    static void EncodeRecords(const Slice * records, size_t n, size_t * offsets, std::string * dst) {
+        size_t request = 0;
+        for (size_t i = 0; i < n; ++i) {
+            request += kMaxVarint32Length + records[i].size() + sizeof(uint32_t);
+        }
+        dst->reserve(dst->size() + request);
+
+        for (size_t i = 0; i < n; ++i) {
+            const Slice & s = records[i];
+            offsets[i] = dst->size();
+            PutVarint32(dst, static_cast<uint32_t>(s.size()));
+            dst->append(s.data(), s.size());
+            const uint32_t crc = crc32c::Mask(crc32c::Value(s.data(), s.size()));
+            dst->append(reinterpret_cast<const char *>(&crc), sizeof(crc));
+        }
+    }
+
+    WriterLite::Writer::Writer(const Slice & slice, Callback cb, bool encoded)
+            : copy(cb != nullptr ? slice.ToString() : std::string()),
+              s(cb != nullptr ? Slice(copy) : slice),
+              head_size(encoded ? 0 : static_cast<size_t>(EncodeVarint32(head, static_cast<uint32_t>(s.size())) - head)),
+              crc(encoded ? 0 : crc32c::Mask(crc32c::Value(s.data(), s.size()))),
+              pos(0),
+              len(encoded ? s.size() : head_size + s.size() + sizeof(crc)),
+              done(false),
+              parked(false),
+              encoded(encoded),
+              batched(false),
+              callback(std::move(cb)) {}
+
+    WriterLite::~WriterLite() {
+        if (flusher_.joinable()) {
+            {
+                std::lock_guard l(mutex_);
+                stop_ = true;
+            }
+            flusher_cv_.notify_one();
+            flusher_.join();
+        }
+    }
+
     size_t WriterLite::Add(const char * data, size_t * n) {
         Writer w({data, *n});
+        Append(&w);
+        *n = w.len;
+        return w.pos;
+    }
+
+    void WriterLite::AddBatch(const Slice * records, size_t n, size_t * ids) {
+        std::string frames;
+        EncodeRecords(records, n, ids, &frames);
+        Writer w(frames, nullptr, true);
+        Append(&w);
+        for (size_t i = 0; i < n; ++i) {
+            ids[i] += w.pos;
+        }
+    }
+
+    void WriterLite::Append(Writer * w) {
         std::unique_lock l(mutex_);
-        writers_.emplace_back(&w);
-        w.cv.wait(l, [&]() {
-            return w.done || &w == writers_.front();
-        });
+        if (eptr_ != nullptr) {
+            std::rethrow_exception(eptr_);
+        }
+        w->pos = cursor_;
+        cursor_ += w->len;
+        writers_.emplace_back(w);
+        auto ready = [&]() {
+            if (w->done || w->batched || formed_ - written_ >= 2) {
+                return w->done.load();
+            }
+            return w == writers_.front() || (in_callbacks_ && writers_.front()->callback != nullptr);
+        };
 
-        // follower
-        if (w.done) {
-            if (w.eptr != nullptr) {
-                std::rethrow_exception(w.eptr);
-            } else {
-                *n = w.len;
-                return w.pos;
+        // a fast helper finishes the batch sooner than a sleep/wake round trip
+        if (!ready() && spin_ > 0) {
+            l.unlock();
+            for (size_t i = 0; i < spin_ && !w->done.load(std::memory_order_acquire); ++i) {
+                CpuRelax();
+            }
+            if (!w->done.load(std::memory_order_acquire)) {
+                l.lock();
             }
         }
 
-        // leader
-        backup_.clear();
-        Writer * last_writer = &w;
-        for (Writer * writer:writers_) {
-            writer->pos = cursor_ + backup_.size();
-            writer->len = PutPlain(writer->s, &backup_);
-            last_writer = writer;
-        }
+        if (l.owns_lock()) {
+            w->parked = true;
+            w->cv.wait(l, ready);
 
-        {
-            mutex_.unlock();
-            try {
-                helper_->Write(backup_);
-                cursor_ += backup_.size();
-            } catch (const std::exception & e) {
-                w.eptr = std::current_exception();
+            // leader
+            if (!w->done) {
+                WriteBatch(l, &w->cv);
             }
-            mutex_.lock();
         }
 
+        if (w->eptr != nullptr) {
+            std::rethrow_exception(w->eptr);
+        }
+    }
+
+    size_t WriterLite::AddAsync(const char * data, size_t * n, Callback callback) {
+        auto * w = new Writer({data, *n}, std::move(callback));
+        std::unique_lock l(mutex_);
+        if (eptr_ != nullptr) {
+            delete w;
+            std::rethrow_exception(eptr_);
+        }
+        if (!flusher_.joinable()) {
+            flusher_ = std::thread(&WriterLite::Flush, this);
+        }
+        w->pos = cursor_;
+        cursor_ += w->len;
+        writers_.emplace_back(w);
+        if (writers_.size() == 1) {
+            flusher_cv_.notify_one();
+        }
+        *n = w->len;
+        return w->pos;
+    }
+
+    void WriterLite::Flush() {
+        std::unique_lock l(mutex_);
         while (true) {
-            Writer * ready = writers_.front();
-            writers_.pop_front();
-            if (ready != &w) {
-                if (w.eptr != nullptr) {
-                    ready->eptr = w.eptr;
+            auto ready = [&]() {
+                return !writers_.empty() && writers_.front()->callback != nullptr && formed_ - written_ < 2;
+            };
+            flusher_cv_.wait(l, [&]() {
+                return ready() || !completed_.empty() || (stop_ && writers_.empty());
+            });
+            // callbacks first, a steady stream of AddAsync must not hold them back
+            if (completed_.empty()) {
+                if (!ready()) {
+                    break;
                 }
-                ready->done = true;
-                ready->cv.notify_one();
+                WriteBatch(l, &flusher_cv_);
+                continue;
             }
-            if (ready == last_writer) {
-                break;
+
+            // a callback may Add, and wait behind an async front that flusher_ cannot lead right now
+            std::vector<Writer *> completed;
+            completed.swap(completed_);
+            in_callbacks_ = true;
+            NotifyFront();
+            l.unlock();
+            for (Writer * writer:completed) {
+                writer->callback(writer->eptr);
+                delete writer;
             }
+            l.lock();
+            in_callbacks_ = false;
+        }
+    }
+
+    void WriterLite::NotifyFront() {
+        if (writers_.empty()) {
+            return;
         }
-        if (!writers_.empty()) {
+        if (writers_.front()->callback == nullptr) {
             writers_.front()->cv.notify_one();
+            return;
+        }
+        flusher_cv_.notify_one();
+        if (in_callbacks_) {
+            for (Writer * writer:writers_) {
+                if (writer->callback == nullptr) {
+                    writer->cv.notify_one();
+                    break;
+                }
+            }
         }
+    }
 
-        if (w.eptr != nullptr) {
-            std::rethrow_exception(w.eptr);
-        } else {
-            *n = w.len;
-            return w.pos;
+    void WriterLite::WriteBatch(std::unique_lock<std::mutex> & l, std::condition_variable * cv) {
+        const size_t seq = formed_++;
+        Batch & batch = batches_[seq % 2];
+        batch.writers.assign(writers_.cbegin(), writers_.cend());
+        for (Writer * writer:writers_) {
+            writer->batched = true;
         }
+        batch.cv = cv;
+        batch.slices.clear();
+        writers_.clear();
+
+        // payloads are handed to the helper in place, no group copy
+        auto add_slices = [&batch](size_t from) {
+            for (size_t i = from; i < batch.writers.size(); ++i) {
+                Writer * writer = batch.writers[i];
+                if (writer->encoded) {
+                    batch.slices.emplace_back(writer->s);
+                    continue;
+                }
+                batch.slices.emplace_back(writer->head, writer->head_size);
+                batch.slices.emplace_back(writer->s);
+                batch.slices.emplace_back(reinterpret_cast<const char *>(&writer->crc), sizeof(writer->crc));
+            }
+        };
+
+        // prepare while the previous batch is being written
+        l.unlock();
+        add_slices(0);
+        l.lock();
+        cv->wait(l, [&]() {
+            return written_ == seq;
+        });
+
+        // writers that queued up meanwhile join this batch rather than waiting for the next one,
+        // unless they have formed it already
+        const size_t prepared = batch.writers.size();
+        if (formed_ == seq + 1) {
+            for (Writer * writer:writers_) {
+                writer->batched = true;
+            }
+            batch.writers.insert(batch.writers.cend(), writers_.cbegin(), writers_.cend());
+            writers_.clear();
+        }
+
+        std::exception_ptr eptr = eptr_;
+        if (eptr == nullptr) {
+            l.unlock();
+            try {
+                add_slices(prepared);
+                helper_->WriteV(batch.slices.data(), batch.slices.size());
+            } catch (...) {
+                eptr = std::current_exception();
+            }
+            l.lock();
+            eptr_ = eptr;
+        }
+        ++written_;
+
+        bool has_async = false;
+        for (Writer * writer:batch.writers) {
+            if (writer->callback != nullptr) {
+                writer->eptr = eptr;
+                completed_.emplace_back(writer);
+                has_async = true;
+                continue;
+            }
+            // a writer that is not parked may return, and be gone, as soon as done is set
+            const bool parked = writer->parked && &writer->cv != cv;
+            writer->eptr = eptr;
+            writer->done.store(true, std::memory_order_release);
+            if (parked) {
+                writer->cv.notify_one();
+            }
+        }
+        // the next batch may write, the front of writers_ may form one
+        if (formed_ != written_) {
+            batches_[written_ % 2].cv->notify_one();
+        }
+        NotifyFront();
+        if (has_async && cv != &flusher_cv_) {
+            flusher_cv_.notify_one();
+        }
+    }
+
+    size_t WriterLiteLockFree::Add(const char * data, size_t * n) {
+        Slice s(data, *n);
+        char head[kMaxVarint32Length];
+        const auto head_size = static_cast<size_t>(EncodeVarint32(head, static_cast<uint32_t>(s.size())) - head);
+        const uint32_t crc = crc32c::Mask(crc32c::Value(s.data(), s.size()));
+        const Slice pieces[] = {{head, head_size},
+                                s,
+                                {reinterpret_cast<const char *>(&crc), sizeof(crc)}};
+        *n = head_size + s.size() + sizeof(crc);
+        return Append(pieces, 3, *n);
+    }
+
+    void WriterLiteLockFree::AddBatch(const Slice * records, size_t n, size_t * ids) {
+        std::string frames;
+        EncodeRecords(records, n, ids, &frames);
+
+        // one reservation per chunk that fits in ring_, a single record always does
+        auto end = [&](size_t k) {
+            return k + 1 < n ? ids[k + 1] : frames.size();
+        };
+        size_t i = 0;
+        while (i < n) {
+            size_t j = i + 1;
+            while (j < n && end(j) - ids[i] <= capacity_) {
+                ++j;
+            }
+            const size_t from = ids[i];
+            const size_t to = end(j - 1);
+            const Slice chunk(&frames[from], to - from);
+            const size_t pos = Append(&chunk, 1, chunk.size());
+            for (; i < j; ++i) {
+                ids[i] += pos - from;
+            }
+        }
+    }
+
+    size_t WriterLiteLockFree::Append(const Slice * pieces, size_t n, size_t len) {
+        assert(len <= capacity_);
+        CheckFailed();
+
+        const size_t pos = cursor_.fetch_add(len);
+        const size_t end = pos + len;
+        // ring_ slots are reused once flushed
+        while (end - flushed_.load(std::memory_order_acquire) > capacity_) {
+            CheckFailed();
+            if (!Flush()) {
+                std::this_thread::yield();
+            }
+        }
+
+        size_t at = pos;
+        for (size_t i = 0; i < n; ++i) {
+            Put(at, pieces[i].data(), pieces[i].size());
+            at += pieces[i].size();
+        }
+
+        // publish in reservation order so that [flushed_, committed_) is always complete
+        while (committed_.load(std::memory_order_acquire) != pos) {
+            CheckFailed();
+            std::this_thread::yield();
+        }
+        committed_.store(end, std::memory_order_release);
+
+        while (flushed_.load(std::memory_order_acquire) < end) {
+            CheckFailed();
+            if (!Flush()) {
+                std::this_thread::yield();
+            }
+        }
+        return pos;
     }
 
-    size_t WriterLite::PutPlain(const Slice & s, std::string * dst) {
-        const size_t old_size = dst->size();
-        const size_t request = VarintLength(s.size()) + s.size() + sizeof(uint32_t);
-        dst->resize(old_size + request);
+    void WriterLiteLockFree::Put(size_t pos, const char * data, size_t n) {
+        const size_t offset = pos % capacity_;
+        const size_t first = std::min(n, capacity_ - offset);
+        memcpy(&ring_[offset], data, first);
+        memcpy(&ring_[0], data + first, n - first);
+    }
+
+    bool WriterLiteLockFree::Flush() {
+        bool expected = false;
+        if (!flushing_.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return false;
+        }
 
-        char * d = EncodeVarint32(dst->data() + old_size, static_cast<uint32_t>(s.size()));
-        memcpy(d, s.data(), s.size());
-        d += s.size();
+        const size_t from = flushed_.load(std::memory_order_relaxed);
+        const size_t to = committed_.load(std::memory_order_acquire);
+        if (from < to && !failed_.load(std::memory_order_relaxed)) {
+            try {
+                const size_t offset = from % capacity_;
+                const size_t first = std::min(to - from, capacity_ - offset);
+                const Slice slices[] = {{&ring_[offset], first},
+                                        {&ring_[0], to - from - first}};
+                helper_->WriteV(slices, first < to - from ? 2 : 1);
+                flushed_.store(to, std::memory_order_release);
+            } catch (...) {
+                eptr_ = std::current_exception();
+                failed_.store(true, std::memory_order_release);
+            }
+        }
+        flushing_.store(false, std::memory_order_release);
+        return true;
+    }
 
-        uint32_t crc = crc32c::Mask(crc32c::Value(s.data(), s.size()));
-        memcpy(d, &crc, sizeof(crc));
-        return request;
+    void WriterLiteLockFree::CheckFailed() const {
+        if (failed_.load(std::memory_order_acquire)) {
+            std::rethrow_exception(eptr_);
+        }
     }
 
+    class LiteIterator : public FrameIterator {
+    public:
+        using FrameIterator::FrameIterator;
+
+    protected:
+        bool Expand(size_t /* id */, const Slice & payload, uint32_t crc, Slice * record) override {
+            *record = payload;
+            return crc32c::Value(payload.data(), payload.size()) == crc;
+        }
+    };
+
     size_t ReaderLite::Get(size_t id, std::string * s) const {
+        return Decode(helper_, id, s);
+    }
+
+    size_t ReaderLite::GetView(size_t id, Slice * record, std::string * scratch) const {
+        if (helper_->View(id, kMaxVarint32Length) == nullptr) {
+            return Reader::GetView(id, record, scratch);
+        }
+        Slice payload;
+        uint32_t crc;
+        const size_t next = ViewFrame(helper_, id, &payload, &crc);
+        if (next == 0 || (Sample(verify_every_, &sampled_) && crc32c::Value(payload.data(), payload.size()) != crc)) {
+            return 0;
+        }
+        *record = payload;
+        return next;
+    }
+
+    void ReaderLite::MultiGet(const size_t * ids, size_t n, std::string * s, size_t * results) const {
+        CoalescedMultiGet(helper_, read_window_ != 0 ? read_window_ : kDefaultReadWindow, ids, n,
+                          [&](const Helper * helper, size_t i) {
+                              results[i] = Decode(helper, ids[i], &s[i]);
+                          });
+    }
+
+    std::unique_ptr<Reader::Iterator> ReaderLite::NewIterator(size_t end) const {
+        return std::make_unique<LiteIterator>(helper_, end);
+    }
+
+    size_t ReaderLite::Decode(const Helper * helper, size_t id, std::string * s) const {
         std::string & b = *s;
-        b.resize(kMaxVarint32Length);
-        helper_->ReadAt(id, kMaxVarint32Length, b.data());
-        Slice buf(b);
+        size_t got = 0;
+        if (read_window_ > kMaxVarint32Length) {
+            b.resize(read_window_);
+            got = helper->ReadAtMost(id, read_window_, b.data());
+        }
+        if (got == 0) {
+            got = kMaxVarint32Length;
+            b.resize(got);
+            helper->ReadAt(id, got, b.data());
+        }
+
+        Slice buf(b.data(), got);
         uint32_t size;
         if (!GetVarint32(&buf, &size)) {
             return 0;
         }
 
-        const size_t varint_size = b.size() - buf.size();
+        const size_t varint_size = got - buf.size();
         const size_t data_size = varint_size + size;
         const size_t read_size = data_size + sizeof(uint32_t);
         b.resize(read_size);
-        helper_->ReadAt(id + kMaxVarint32Length,
-                        read_size - kMaxVarint32Length,
-                        &b[kMaxVarint32Length]);
+        // the record is larger than what has been read
+        if (read_size > got) {
+            helper->ReadAt(id + got, read_size - got, &b[got]);
+        }
 
         uint32_t crc;
         memcpy(&crc, &b[data_size], sizeof(crc));
         crc = crc32c::Unmask(crc);
         buf = {&b[varint_size], size};
 
-        if (crc32c::Value(buf.data(), buf.size()) != crc) {
+        if (Sample(verify_every_, &sampled_) && crc32c::Value(buf.data(), buf.size()) != crc) {
             return 0;
         }
         memmove(s->data(), buf.data(), buf.size());
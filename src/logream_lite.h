@@ -10,64 +10,179 @@
  * 不进行压缩, 以极限速度将数据写入且线程安全
  *
  * 单记录最大长度: 64KB 格式: varint + data + crc32c
+ *
+ * 偏移量在入队时按顺序分配, 排队的记录由队首线程(leader)成批写入
+ * 两个批次交替: 一批在 Helper::Write 中时, 下一批已在组建, Helper::Write 仍串行且有序
+ * 偏移量先于写入分配, 所以任何一次写入失败后, 之后的 Add 都抛出同一异常
+ * 等待的线程先自旋观察完成标志, 超过 spin 轮后才在条件变量上休眠, 避免快速 Helper 下的唤醒开销
+ * AddAsync 复制记录后立即返回偏移量; 队首为异步记录时, 由后台线程充当 leader
+ * 回调只在后台线程上、批次写完之后执行, 不计入任何 Add 的延迟; 回调中可以再次 Add/AddAsync,
+ * 后台线程执行回调期间, 队首的异步记录由排队的同步写入者代为写入
+ *
+ * WriterLiteLockFree 格式与 Add 语义相同, 但不加锁:
+ * 以 fetch-add 预留日志空间, 各线程直接把记录编码进共享环形缓冲区,
+ * 按预留顺序发布后, 由任意一个空闲线程把连续完成的区间交给 Helper::Write
  */
 
+#include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
+#include "coding.h"
 #include "logream.h"
 
 namespace logream {
     class WriterLite : public Writer {
     private:
-        Helper * const helper_;
-        size_t cursor_;
-        std::string backup_;
-
         struct Writer {
+            std::string copy; // async writers own their payload
             Slice s;
+            char head[kMaxVarint32Length];
+            size_t head_size;
+            uint32_t crc;
             size_t pos;
             size_t len;
             std::condition_variable cv;
-            std::exception_ptr eptr;
-            bool done;
-
-            explicit Writer(const Slice & slice)
-                    : s(slice),
-                      pos(0),
-                      len(0),
-                      done(false) {}
+            std::exception_ptr eptr;  // published by done
+            std::atomic<bool> done;
+            bool parked;              // waiting on cv, the leader must notify it
+            bool encoded;             // s holds whole frames, AddBatch
+            bool batched;             // taken into a batch, it must not lead another one
+            Callback callback; // async writers only
+
+            // varint and crc32c are computed by the producer itself, before it queues up
+            explicit Writer(const Slice & slice, Callback cb = nullptr, bool encoded = false);
+        };
+
+        struct Batch {
+            std::vector<Writer *> writers;
+            std::vector<Slice> slices;
+            std::condition_variable * cv = nullptr; // where its leader waits for the turn to write
         };
 
+        Helper * const helper_;
+        const size_t spin_;
+        size_t cursor_; // next offset to hand out
+        Batch batches_[2];
+        size_t formed_ = 0;
+        size_t written_ = 0;
+        std::exception_ptr eptr_;
+
         std::deque<Writer *> writers_;
         std::mutex mutex_;
 
+        std::thread flusher_; // leads batches fronted by async writers, started on first AddAsync
+        std::condition_variable flusher_cv_;
+        std::vector<Writer *> completed_; // async writers written, their callbacks are due on flusher_
+        bool in_callbacks_ = false;       // flusher_ runs callbacks, sync writers lead async fronts meanwhile
+        bool stop_ = false;
+
     public:
-        WriterLite(Helper * helper, size_t cursor)
+        static constexpr size_t kDefaultSpin = 2048;
+
+        // spin: pause rounds a follower watches its done flag before parking on its cv, 0 parks at once
+        // Spinning only pays off with a spare core, single-core machines always park
+        WriterLite(Helper * helper, size_t cursor, size_t spin = kDefaultSpin)
                 : helper_(helper),
+                  spin_(std::thread::hardware_concurrency() > 1 ? spin : 0),
                   cursor_(cursor) {}
 
         WriterLite(const WriterLite &) = delete;
 
         WriterLite & operator=(const WriterLite &) = delete;
 
-        ~WriterLite() override = default;
+        ~WriterLite() override;
 
     public:
         size_t Add(const char * data, size_t * n) override;
 
+        size_t AddAsync(const char * data, size_t * n, Callback callback) override;
+
+        // The batch is encoded up front and queued as a single writer, so its records stay contiguous
+        void AddBatch(const Slice * records, size_t n, size_t * ids) override;
+
     private:
-        static size_t PutPlain(const Slice & s, std::string * dst);
+        // Queue w, wait for it to be written, leading its batch if it gets to the front
+        void Append(Writer * w);
+
+        // flusher_ body, returns once stopped and both writers_ and completed_ are empty
+        void Flush();
+
+        // Wake the thread that leads writers_.front(): its producer, or flusher_ if it is async,
+        // or a queued sync writer while flusher_ is busy with callbacks
+        void NotifyFront();
+
+        // Take writers_ as the next batch, write it once the previous batch is written
+        void WriteBatch(std::unique_lock<std::mutex> & l, std::condition_variable * cv);
+    };
+
+    class WriterLiteLockFree : public Writer {
+    private:
+        Helper * const helper_;
+        const size_t capacity_;
+        std::unique_ptr<char[]> ring_;
+        std::atomic<size_t> cursor_;    // reserved up to
+        std::atomic<size_t> committed_; // encoded into ring_ up to
+        std::atomic<size_t> flushed_;   // written through helper_ up to
+        std::atomic<bool> flushing_;
+        std::atomic<bool> failed_;
+        std::exception_ptr eptr_;       // published by failed_
+
+    public:
+        static constexpr size_t kDefaultCapacity = 4194304; // 4MB
+
+        WriterLiteLockFree(Helper * helper, size_t cursor, size_t capacity = kDefaultCapacity)
+                : helper_(helper),
+                  capacity_(capacity),
+                  ring_(new char[capacity]),
+                  cursor_(cursor),
+                  committed_(cursor),
+                  flushed_(cursor),
+                  flushing_(false),
+                  failed_(false) {}
+
+        WriterLiteLockFree(const WriterLiteLockFree &) = delete;
+
+        WriterLiteLockFree & operator=(const WriterLiteLockFree &) = delete;
+
+        ~WriterLiteLockFree() override = default;
+
+    public:
+        size_t Add(const char * data, size_t * n) override;
+
+        void AddBatch(const Slice * records, size_t n, size_t * ids) override;
+
+    private:
+        // Reserve len bytes, copy pieces there and wait until they are written, return the offset
+        size_t Append(const Slice * pieces, size_t n, size_t len);
+
+        void Put(size_t pos, const char * data, size_t n);
+
+        // Return false if another thread is flushing
+        bool Flush();
+
+        void CheckFailed() const;
     };
 
     class ReaderLite : public Reader {
     private:
         Helper * const helper_;
+        const size_t read_window_;
+        const size_t verify_every_;
+        mutable std::atomic<size_t> sampled_{0}; // point reads counted for verify_every_
 
     public:
-        explicit ReaderLite(Helper * helper)
-                : helper_(helper) {}
+        // read_window: bytes fetched with one Helper::ReadAtMost per Get, 0 to always read exactly
+        // verify_every: how often Get, GetView and MultiGet check crc32c, see kVerifyAlways
+        explicit ReaderLite(Helper * helper, size_t read_window = kDefaultReadWindow,
+                            size_t verify_every = kVerifyAlways)
+                : helper_(helper),
+                  read_window_(read_window),
+                  verify_every_(verify_every) {}
 
         ReaderLite(const ReaderLite &) = delete;
 
@@ -77,6 +192,18 @@ namespace logream {
 
     public:
         size_t Get(size_t id, std::string * s) const override;
+
+        // No copy if helper_ maps id, *record then points into the mapping
+        size_t GetView(size_t id, Slice * record, std::string * scratch) const override;
+
+        // Nearby ids share one read
+        void MultiGet(const size_t * ids, size_t n, std::string * s, size_t * results) const override;
+
+        // Reads 1MB blocks, records point into the block
+        std::unique_ptr<Iterator> NewIterator(size_t end) const override;
+
+    private:
+        size_t Decode(const Helper * helper, size_t id, std::string * s) const;
     };
 }
 
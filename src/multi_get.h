@@ -0,0 +1,95 @@
+#pragma once
+#ifndef LOGREAM_MULTI_GET_H
+#define LOGREAM_MULTI_GET_H
+
+/*
+ * MultiGet 的 I/O 合并
+ *
+ * ID 按偏移量排序, 每个 ID 预读 [id, id + window), 相互重叠, 相邻或间隔不超过 window 的区间合并为一次 ReadAtMost
+ * 区间内的记录从内存解码, 超出区间的部分才回到原 Helper 读取
+ */
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include "logream.h"
+
+namespace logream {
+    // Serves reads inside the range it holds from memory, the rest from base
+    class RangeReaderHelper : public Reader::Helper {
+    private:
+        const Reader::Helper * const base_;
+        size_t offset_ = 0;
+        std::string buf_;
+
+    public:
+        explicit RangeReaderHelper(const Reader::Helper * base)
+                : base_(base) {}
+
+        RangeReaderHelper(const RangeReaderHelper &) = delete;
+
+        RangeReaderHelper & operator=(const RangeReaderHelper &) = delete;
+
+        ~RangeReaderHelper() override = default;
+
+    public:
+        // Hold [offset, offset + n) read with one base->ReadAtMost, return false if base does not support it
+        bool Fill(size_t offset, size_t n) {
+            buf_.resize(n);
+            buf_.resize(base_->ReadAtMost(offset, n, buf_.data()));
+            offset_ = offset;
+            return !buf_.empty();
+        }
+
+        void ReadAt(size_t offset, size_t n, char * scratch) const override {
+            if (offset >= offset_ && offset + n <= offset_ + buf_.size()) {
+                memcpy(scratch, &buf_[offset - offset_], n);
+            } else {
+                base_->ReadAt(offset, n, scratch);
+            }
+        }
+
+        // Short at the end of the range, not only at the end of the log: readers ReadAt the rest
+        size_t ReadAtMost(size_t offset, size_t n, char * scratch) const override {
+            if (offset >= offset_ && offset < offset_ + buf_.size()) {
+                n = std::min(n, offset_ + buf_.size() - offset);
+                memcpy(scratch, &buf_[offset - offset_], n);
+                return n;
+            }
+            return base_->ReadAtMost(offset, n, scratch);
+        }
+    };
+
+    // Call decode(helper, i) for every ids[i] in offset order, helper holds the coalesced range around ids[i]
+    template<typename Decode>
+    void CoalescedMultiGet(const Reader::Helper * helper, size_t window,
+                           const size_t * ids, size_t n, Decode && decode) {
+        constexpr size_t kMaxRange = 1048576; // 1MB
+
+        std::vector<size_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [ids](size_t a, size_t b) {
+            return ids[a] < ids[b];
+        });
+
+        RangeReaderHelper range(helper);
+        size_t i = 0;
+        while (i < n) {
+            const size_t begin = ids[order[i]];
+            size_t end = begin + window;
+            size_t j = i + 1;
+            // a gap up to window is cheaper to read through than to split at
+            for (; j < n && ids[order[j]] <= end + window && ids[order[j]] + window - begin <= kMaxRange; ++j) {
+                end = std::max(end, ids[order[j]] + window);
+            }
+
+            const Reader::Helper * h = range.Fill(begin, end - begin) ? &range : helper;
+            for (; i < j; ++i) {
+                decode(h, order[i]);
+            }
+        }
+    }
+}
+
+#endif //LOGREAM_MULTI_GET_H
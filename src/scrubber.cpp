@@ -0,0 +1,45 @@
+#include "scrubber.h"
+
+namespace logream {
+    Scrubber::Scrubber(const Reader * reader, size_t begin, size_t end)
+            : reader_(reader),
+              begin_(begin),
+              end_(end),
+              verified_(begin) {
+        thread_ = std::thread([this]() {
+            Run();
+        });
+    }
+
+    Scrubber::~Scrubber() {
+        Stop();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    bool Scrubber::Wait() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        if (eptr_ != nullptr) {
+            std::rethrow_exception(eptr_);
+        }
+        return verified_ == end_;
+    }
+
+    void Scrubber::Run() {
+        try {
+            auto it = reader_->NewIterator(end_);
+            it->Seek(begin_);
+            while (it->Valid() && !stop_.load(std::memory_order_relaxed)) {
+                it->Next();
+                // the record just left checked out
+                ++records_;
+                verified_ = it->offset();
+            }
+        } catch (...) {
+            eptr_ = std::current_exception();
+        }
+    }
+}
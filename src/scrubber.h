@@ -0,0 +1,65 @@
+#pragma once
+#ifndef LOGREAM_SCRUBBER_H
+#define LOGREAM_SCRUBBER_H
+
+/*
+ * 后台校验
+ *
+ * 在后台线程中用 Reader 的迭代器顺序读取 [begin, end), 迭代器总是校验 crc32c
+ * 迭代器以大块读取, 校验可跑满带宽, 点读因此可以关闭或抽样校验而不失去完整性的覆盖
+ * 遇到第一个损坏的帧即停止, 之后的帧无法定位; verified() 之前的记录均已通过校验
+ */
+
+#include <atomic>
+#include <exception>
+#include <thread>
+
+#include "logream.h"
+
+namespace logream {
+    class Scrubber {
+    private:
+        const Reader * const reader_;
+        const size_t begin_;
+        const size_t end_;
+        std::atomic<size_t> verified_;
+        std::atomic<size_t> records_{0};
+        std::atomic<bool> stop_{false};
+        std::exception_ptr eptr_;
+        std::thread thread_;
+
+    public:
+        // Start verifying the records in [begin, end) of reader, begin is a record id, end the size of the log
+        Scrubber(const Reader * reader, size_t begin, size_t end);
+
+        Scrubber(const Scrubber &) = delete;
+
+        Scrubber & operator=(const Scrubber &) = delete;
+
+        ~Scrubber();
+
+    public:
+        // Stop at the next record, Wait then returns false
+        void Stop() {
+            stop_ = true;
+        }
+
+        // Block until the scrub ends, true if every record in [begin, end) checks out
+        // Rethrow the error of a failed read
+        bool Wait();
+
+        // Every record before this offset checks out, it is the offset of the corrupted frame once Wait returns false
+        size_t verified() const {
+            return verified_;
+        }
+
+        size_t records() const {
+            return records_;
+        }
+
+    private:
+        void Run();
+    };
+}
+
+#endif //LOGREAM_SCRUBBER_H
@@ -0,0 +1,86 @@
+#include "thread_pool.h"
+
+namespace logream {
+    ThreadPool::ThreadPool(size_t n) {
+        threads_.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            threads_.emplace_back(&ThreadPool::Loop, this);
+        }
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard l(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto & thread:threads_) {
+            thread.join();
+        }
+    }
+
+    void ThreadPool::ParallelFor(size_t n, const std::function<void(size_t)> & f) {
+        if (threads_.empty() || n <= 1) {
+            for (size_t i = 0; i < n; ++i) {
+                f(i);
+            }
+            return;
+        }
+
+        std::unique_lock l(mutex_);
+        job_ = &f;
+        n_ = n;
+        next_ = 0;
+        eptr_ = nullptr;
+        ++generation_;
+        l.unlock();
+        cv_.notify_all();
+
+        Drain(f, n);
+
+        l.lock();
+        done_cv_.wait(l, [this]() { return running_ == 0; });
+        // late workers must not pick up a finished job
+        job_ = nullptr;
+        if (eptr_ != nullptr) {
+            std::rethrow_exception(eptr_);
+        }
+    }
+
+    void ThreadPool::Loop() {
+        size_t seen = 0;
+        std::unique_lock l(mutex_);
+        while (true) {
+            cv_.wait(l, [this, &seen]() { return stop_ || (job_ != nullptr && generation_ != seen); });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+            const auto & f = *job_;
+            const size_t n = n_;
+            ++running_;
+            l.unlock();
+
+            Drain(f, n);
+
+            l.lock();
+            if (--running_ == 0) {
+                done_cv_.notify_one();
+            }
+        }
+    }
+
+    void ThreadPool::Drain(const std::function<void(size_t)> & f, size_t n) {
+        for (size_t i; (i = next_.fetch_add(1, std::memory_order_relaxed)) < n;) {
+            try {
+                f(i);
+            } catch (...) {
+                std::lock_guard l(mutex_);
+                if (eptr_ == nullptr) {
+                    eptr_ = std::current_exception();
+                }
+                next_ = n;
+            }
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+#ifndef LOGREAM_THREAD_POOL_H
+#define LOGREAM_THREAD_POOL_H
+
+/*
+ * 固定大小的线程池, 只提供 fork-join 式的 ParallelFor
+ * 调用线程同样参与计算, 同一时刻只允许一个调用者
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logream {
+    class ThreadPool {
+    private:
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::condition_variable done_cv_;
+        const std::function<void(size_t)> * job_ = nullptr;
+        size_t n_ = 0;
+        std::atomic<size_t> next_{0};
+        size_t running_ = 0;
+        size_t generation_ = 0;
+        std::exception_ptr eptr_;
+        bool stop_ = false;
+
+    public:
+        explicit ThreadPool(size_t n);
+
+        ThreadPool(const ThreadPool &) = delete;
+
+        ThreadPool & operator=(const ThreadPool &) = delete;
+
+        ~ThreadPool();
+
+    public:
+        // Run f(0) ... f(n - 1), rethrow the first exception after all have stopped
+        void ParallelFor(size_t n, const std::function<void(size_t)> & f);
+
+        // background threads, not counting the caller
+        size_t size() const { return threads_.size(); }
+
+    private:
+        void Loop();
+
+        void Drain(const std::function<void(size_t)> & f, size_t n);
+    };
+}
+
+#endif //LOGREAM_THREAD_POOL_H